@@ -39,14 +39,36 @@ void stack_walk(void)
     /* TODO */
 }
 
+/* The register stack grows up from the base, stacks are always full size */
+char *
+arch_alloc_stack(unsigned long size)
+{
+	/* Allocate pages for stack, stack will be aligned */
+	return (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+}
+
+void
+arch_free_stack(char *stack, unsigned long size)
+{
+	free_pages(stack, STACK_SIZE_PAGE_ORDER);
+}
+
+unsigned long
+arch_stack_usable(unsigned long size)
+{
+	return STACK_SIZE;
+}
+
 struct thread*
-arch_create_thread(char *name, void (*function)(void *), void *data)
+arch_create_thread(char *name, void (*function)(void *), void *data,
+		   char *stack, unsigned long stack_size)
 {
 	struct thread* _thread;
 
 	_thread = (struct thread*)_xmalloc(sizeof(struct thread), 16);
-	/* Allocate pages for stack, stack will be aligned */
-	_thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+	_thread->stack = stack;
+	_thread->stack_size = stack_size;
+	_thread->stack_limit = NULL;
 	_thread->name = name;
 	memset((void*)&(_thread->regs), 0, sizeof(_thread->regs));
 	_thread->regs.sp = ((uint64_t)_thread->stack) + STACK_SIZE - 16;
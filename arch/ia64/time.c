@@ -131,9 +131,11 @@ block_domain(s_time_t until)
 	struct ia64_pal_result pal_res;
 	uint64_t c, new;
 
-	c = ns_to_cycles(until);
-	new = ia64_get_itc() + c - NOW();
-	ia64_set_itm(new);		/* Reload cr.itm */
+	if (until) {
+		c = ns_to_cycles(until);
+		new = ia64_get_itc() + c - NOW();
+		ia64_set_itm(new);	/* Reload cr.itm */
+	}
 	/*
 	 * PAL_HALT_LIGHT returns on every external interrupt,
 	 * including timer interrupts.
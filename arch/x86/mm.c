@@ -546,7 +546,7 @@ unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
                 pgt = get_pgt(addr);
             if ( pgt )
             {
-                if ( *pgt & _PAGE_PRESENT )
+                if ( *pgt & (_PAGE_PRESENT|_PAGE_ONDEMAND) )
                     break;
                 pgt++;
             }
@@ -651,10 +651,13 @@ void *map_frames_ex(const unsigned long *mfns, unsigned long n,
 /*
  * Unmap nun_frames frames mapped at virtual address va.
  */
-#define UNMAP_BATCH ((STACK_SIZE / 2) / sizeof(multicall_entry_t))
-int unmap_frames(unsigned long va, unsigned long num_frames)
+/* Batches of 16, so that call[] stays far smaller than the guard page
+ * below thread stacks */
+#define UNMAP_BATCH 16
+static int clear_frames(unsigned long va, unsigned long num_frames, pgentry_t val)
 {
-    int n = UNMAP_BATCH;
+    /* Only as large as needed, this may run on a small thread stack */
+    int n = num_frames < UNMAP_BATCH ? num_frames : UNMAP_BATCH;
     multicall_entry_t call[n];
     int ret;
     int i;
@@ -673,9 +676,9 @@ int unmap_frames(unsigned long va, unsigned long num_frames)
             /* simply update the PTE for the VA and invalidate TLB */
             call[i].op = __HYPERVISOR_update_va_mapping;
             call[i].args[arg++] = va;
-            call[i].args[arg++] = 0;
+            call[i].args[arg++] = val;
 #ifdef __i386__
-            call[i].args[arg++] = 0;
+            call[i].args[arg++] = val >> 32;
 #endif  
             call[i].args[arg++] = UVMF_INVLPG;
 
@@ -702,6 +705,21 @@ int unmap_frames(unsigned long va, unsigned long num_frames)
     return 0;
 }
 
+int unmap_frames(unsigned long va, unsigned long num_frames)
+{
+    return clear_frames(va, num_frames, 0);
+}
+
+/*
+ * Unmap frames but keep the range allocated: the PTEs are left not present,
+ * and allocate_ondemand will not hand the range out again until it is
+ * released with unmap_frames.
+ */
+int reserve_frames(unsigned long va, unsigned long num_frames)
+{
+    return clear_frames(va, num_frames, _PAGE_ONDEMAND);
+}
+
 /*
  * Allocate pages which are contiguous in machine memory.
  * Returns a VA to where they are mapped or 0 on failure.
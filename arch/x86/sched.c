@@ -91,15 +91,78 @@ static void stack_push(struct thread *thread, unsigned long value)
     *((unsigned long *)thread->sp) = value;
 }
 
+/*
+ * current is found at the base of the STACK_SIZE aligned region holding the
+ * stack, so each stack takes a whole aligned region of virtual memory.  Only
+ * its base page and its top are backed by memory.  The gap is kept reserved
+ * and unmapped, at least one guard page, so that overflows fault instead of
+ * overwriting the thread pointer.  Stack frames must stay well below a page,
+ * or they could jump over it.
+ * We can't use lazy allocation here since the trap handler runs on the stack.
+ */
+unsigned long arch_stack_usable(unsigned long size)
+{
+    if (size > STACK_SIZE - 2 * PAGE_SIZE)
+        return STACK_SIZE - 2 * PAGE_SIZE;
+    return size;
+}
+
+char *arch_alloc_stack(unsigned long size)
+{
+    unsigned long mfns[STACK_SIZE / PAGE_SIZE];
+    unsigned long va, flags, mapped = arch_stack_usable(size);
+    int i, n = mapped / PAGE_SIZE + 1;
+
+    for (i = 0; i < n; i++) {
+        unsigned long page = alloc_page();
+
+        if (!page) {
+            while (i--)
+                free_page(mfn_to_virt(mfns[i]));
+            return NULL;
+        }
+        mfns[i] = virt_to_mfn(page);
+    }
+
+    local_irq_save(flags);
+    va = allocate_ondemand(STACK_SIZE / PAGE_SIZE, STACK_SIZE / PAGE_SIZE);
+    if (va) {
+        do_map_frames(va, mfns, 1, 1, 0, DOMID_SELF, NULL, L1_PROT);
+        do_map_frames(va + STACK_SIZE - mapped, mfns + 1, n - 1, 1, 0,
+                      DOMID_SELF, NULL, L1_PROT);
+        reserve_frames(va + PAGE_SIZE, (STACK_SIZE - mapped) / PAGE_SIZE - 1);
+    }
+    local_irq_restore(flags);
+    if (!va)
+        for (i = 0; i < n; i++)
+            free_page(mfn_to_virt(mfns[i]));
+    return (char *)va;
+}
+
+void arch_free_stack(char *stack, unsigned long size)
+{
+    unsigned long mfns[STACK_SIZE / PAGE_SIZE];
+    unsigned long va = (unsigned long)stack;
+    int i, n = arch_stack_usable(size) / PAGE_SIZE + 1;
+
+    mfns[0] = virtual_to_mfn(va);
+    for (i = 1; i < n; i++)
+        mfns[i] = virtual_to_mfn(va + STACK_SIZE - (n - i) * PAGE_SIZE);
+    unmap_frames(va, STACK_SIZE / PAGE_SIZE);
+    for (i = 0; i < n; i++)
+        free_page(mfn_to_virt(mfns[i]));
+}
+
 /* Architecture specific setup of thread creation */
 struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data)
+                                  void *data, char *stack,
+                                  unsigned long stack_size)
 {
     struct thread *thread;
     
     thread = xmalloc(struct thread);
-    /* We can't use lazy allocation here since the trap handler runs on the stack */
-    thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+    thread->stack = stack;
+    thread->stack_size = stack_size;
     thread->name = name;
     printk("Thread \"%s\": pointer: 0x%lx, stack: 0x%lx\n", name, thread, 
             thread->stack);
@@ -107,6 +170,9 @@ struct thread* arch_create_thread(char *name, void (*function)(void *),
     thread->sp = (unsigned long)thread->stack + STACK_SIZE;
     /* Save pointer to the thread on the stack, used by current macro */
     *((unsigned long *)thread->stack) = (unsigned long)thread;
+    /* Fill the stack to find its high-water mark later */
+    thread->stack_limit = (char *)thread->sp - arch_stack_usable(stack_size);
+    memset(thread->stack_limit, STACK_FILL, arch_stack_usable(stack_size));
     
     stack_push(thread, (unsigned long) function);
     stack_push(thread, (unsigned long) data);
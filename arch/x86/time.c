@@ -39,6 +39,8 @@
 #include <mini-os/events.h>
 #include <mini-os/time.h>
 #include <mini-os/lib.h>
+#include <mini-os/sched.h>
+#include <xen/vcpu.h>
 
 /************************************************************************
  * Time functions
@@ -57,6 +59,8 @@ static struct timespec shadow_ts;
 static uint32_t shadow_ts_version;
 
 static struct shadow_time_info shadow;
+/* Deadline of the one-shot timer armed in Xen, 0 if none */
+static s_time_t timer_armed;
 
 
 #ifndef rmb
@@ -186,6 +190,10 @@ static void update_wallclock(void)
 int gettimeofday(struct timeval *tv, void *tz)
 {
     uint64_t nsec = monotonic_clock();
+
+    /* There is no periodic tick to keep it up to date */
+    if (shadow_ts_version != HYPERVISOR_shared_info->wc_version)
+        update_wallclock();
     nsec += shadow_ts.tv_nsec;
     
     
@@ -197,17 +205,32 @@ int gettimeofday(struct timeval *tv, void *tz)
 }
 
 
+/* Arm the one-shot timer at until, or disarm it with 0.  Called with IRQs
+ * disabled. */
+void set_timer(s_time_t until)
+{
+    if (until == timer_armed)
+        return;
+    HYPERVISOR_set_timer_op(until);
+    timer_armed = until;
+}
+
+void set_timer_before(s_time_t until)
+{
+    if (timer_armed && timer_armed <= until)
+        return;
+    set_timer(until);
+}
+
+/* Block until an event, or until until unless it is 0 */
 void block_domain(s_time_t until)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
     ASSERT(irqs_disabled());
-    if(monotonic_clock() < until)
-    {
-        HYPERVISOR_set_timer_op(until);
-        HYPERVISOR_sched_op(SCHEDOP_block, 0);
-        local_irq_disable();
-    }
+    if (until && monotonic_clock() >= until)
+        return;
+    set_timer(until);
+    HYPERVISOR_sched_op(SCHEDOP_block, 0);
+    local_irq_disable();
 }
 
 
@@ -218,6 +241,14 @@ static void timer_handler(evtchn_port_t ev, struct pt_regs *regs, void *ign)
 {
     get_time_values_from_xen();
     update_wallclock();
+    /* Without the periodic timer, only the one-shot one raises the VIRQ.
+     * Forget it whatever our clock says: if ours lags behind Xen's, a stale
+     * deadline would keep the next block_domain() from re-arming it.  At
+     * worst, a deadline set after it fired is armed again needlessly. */
+    timer_armed = 0;
+#ifdef CONFIG_PREEMPT
+    sched_tick();
+#endif
 }
 
 
@@ -227,6 +258,8 @@ void init_time(void)
 {
     printk("Initialising timer interface\n");
     port = bind_virq(VIRQ_TIMER, &timer_handler, NULL);
+    /* Only wake up for the one-shot timer, not every 10ms */
+    HYPERVISOR_vcpu_op(VCPUOP_stop_periodic_timer, smp_processor_id(), NULL);
     unmask_evtchn(port);
 }
 
@@ -234,5 +267,6 @@ void fini_time(void)
 {
     /* Clear any pending timer */
     HYPERVISOR_set_timer_op(0);
+    timer_armed = 0;
     unbind_evtchn(port);
 }
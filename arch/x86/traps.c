@@ -5,6 +5,9 @@
 #include <mini-os/mm.h>
 #include <mini-os/lib.h>
 #include <mini-os/sched.h>
+#ifdef CONFIG_BLKFRONT
+#include <mini-os/blkfront.h>
+#endif
 
 /*
  * These are assembler stubs in entry.S.
@@ -202,6 +205,23 @@ void do_page_fault(struct pt_regs *regs, unsigned long error_code)
     if ((error_code & TRAP_PF_WRITE) && handle_cow(addr))
 	return;
 
+#ifdef CONFIG_BLKFRONT
+    /* The page fault gate leaves events as the faulting code had them.
+     * Reading pages in from the device sleeps, so only do it when they were
+     * enabled and the thread is not already serving such a fault: code
+     * touching mapped buffers with events disabled pins them first, see
+     * blkfront_map_pin.  Other faults are fatal below.  */
+    if (!irqs_disabled() && !(current->flags & MAP_FAULT_FLAG)) {
+        int ret;
+
+        current->flags |= MAP_FAULT_FLAG;
+        ret = blkfront_map_fault(addr, error_code & TRAP_PF_WRITE);
+        current->flags &= ~MAP_FAULT_FLAG;
+        if (ret)
+            return;
+    }
+#endif
+
     /* If we are already handling a page fault, and got another one
        that means we faulted in pagetable walk. Continuing here would cause
        a recursive fault */       
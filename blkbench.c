@@ -0,0 +1,343 @@
+/* Block device benchmark for Mini-OS.
+ *
+ * Drives the first vbd with a fixed number of asynchronous requests in flight
+ * and reports IOPS, throughput and latency percentiles, much like fio.  The
+ * job is described on the kernel command line, e.g.
+ *
+ *   extra = "rw=randrw rwmix=70 bs=4k iodepth=16 runtime=30"
+ *
+ * rw=        read, write, randread, randwrite, rw or randrw (randread)
+ * rwmix=     percentage of reads for rw and randrw (50)
+ * bs=        request size, a multiple of the sector size (4k)
+ * iodepth=   requests kept in flight (8)
+ * runtime=   in seconds (10)
+ * offset=    start of the region to use (0)
+ * size=      length of the region, 0 for up to the end of the device (0)
+ *
+ * Sizes accept k, m and g suffixes.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/time.h>
+#include <mini-os/lib.h>
+#include <mini-os/sched.h>
+#include <mini-os/blkfront.h>
+#include <mini-os/xmalloc.h>
+#include <fcntl.h>
+
+#define BENCH_MAX_DEPTH 256
+
+/* Latencies are bucketed with 4 bits of precision below the leading one */
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+struct bench_job {
+    int random;
+    /* Percentage of reads */
+    unsigned rwmix;
+    unsigned bs;
+    unsigned depth;
+    unsigned runtime;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct bench_stats {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    s_time_t lat_max;
+    uint64_t lat_hist[LAT_BUCKETS];
+};
+
+struct bench_req {
+    struct blkfront_aiocb aiocb;
+    s_time_t start;
+    int write;
+    int done;
+};
+
+static struct blkfront_dev *bench_dev;
+static struct blkfront_info bench_info;
+static struct bench_job job = {
+    .random = 1,
+    .rwmix = 100,
+    .bs = 4096,
+    .depth = 8,
+    .runtime = 10,
+};
+static struct bench_stats bench_stats[2];
+static struct bench_req bench_reqs[BENCH_MAX_DEPTH];
+static unsigned bench_done, bench_inflight;
+static uint64_t bench_next;
+static uint64_t bench_seed = 0x2545f4914f6cdd1dULL;
+
+static unsigned lat_bucket(uint64_t ns)
+{
+    unsigned msb;
+
+    if (ns < (1 << LAT_SUB_BITS))
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+        | ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* Lowest latency counted in bucket b */
+static uint64_t lat_value(unsigned b)
+{
+    unsigned shift = b >> LAT_SUB_BITS;
+    unsigned sub = b & ((1 << LAT_SUB_BITS) - 1);
+
+    if (!shift)
+        return sub;
+    return (uint64_t) ((1 << LAT_SUB_BITS) | sub) << (shift - 1);
+}
+
+/* xorshift64*, rand() is too slow to be called for each request */
+static uint64_t bench_rand(void)
+{
+    bench_seed ^= bench_seed >> 12;
+    bench_seed ^= bench_seed << 25;
+    bench_seed ^= bench_seed >> 27;
+    return bench_seed * 2685821657736338717ULL;
+}
+
+static uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t v = simple_strtoull(s, &end, 0);
+
+    switch (*end) {
+    case 'g': case 'G':
+        v <<= 10;
+        /* fallthrough */
+    case 'm': case 'M':
+        v <<= 10;
+        /* fallthrough */
+    case 'k': case 'K':
+        v <<= 10;
+    }
+    return v;
+}
+
+static void parse_job(const char *cmdline)
+{
+    const char *p = cmdline;
+    int rwmix = -1;
+
+    while (*p) {
+        const char *arg, *val;
+
+        while (*p == ' ')
+            p++;
+        arg = p;
+        while (*p && *p != ' ')
+            p++;
+        val = strchr(arg, '=');
+        if (!val || val > p)
+            continue;
+        val++;
+
+#define ARG(name) (val - arg == sizeof(name) && !strncmp(arg, name "=", sizeof(name)))
+        if (ARG("rw")) {
+            job.random = !strncmp(val, "rand", 4);
+            if (job.random)
+                val += 4;
+            if (!strncmp(val, "read", 4))
+                job.rwmix = 100;
+            else if (!strncmp(val, "write", 5))
+                job.rwmix = 0;
+            else
+                job.rwmix = 50;
+        } else if (ARG("rwmix"))
+            rwmix = simple_strtoul(val, NULL, 10);
+        else if (ARG("bs"))
+            job.bs = parse_size(val);
+        else if (ARG("iodepth"))
+            job.depth = simple_strtoul(val, NULL, 10);
+        else if (ARG("runtime"))
+            job.runtime = simple_strtoul(val, NULL, 10);
+        else if (ARG("offset"))
+            job.offset = parse_size(val);
+        else if (ARG("size"))
+            job.size = parse_size(val);
+#undef ARG
+    }
+    if (rwmix >= 0 && job.rwmix != 0 && job.rwmix != 100)
+        job.rwmix = rwmix;
+}
+
+static void bench_completed(struct blkfront_aiocb *aiocb, int ret)
+{
+    struct bench_req *req = aiocb->data;
+    struct bench_stats *stats = &bench_stats[req->write];
+    s_time_t lat = NOW() - req->start;
+
+    if (ret)
+        stats->errors++;
+    else {
+        stats->ops++;
+        stats->bytes += aiocb->aio_nbytes;
+    }
+    if (lat > stats->lat_max)
+        stats->lat_max = lat;
+    stats->lat_hist[lat_bucket(lat)]++;
+    req->done = 1;
+    bench_done++;
+    bench_inflight--;
+}
+
+static void bench_prepare(struct bench_req *req)
+{
+    uint64_t blocks = job.size / job.bs;
+
+    if (job.random)
+        req->aiocb.aio_offset = job.offset + (bench_rand() % blocks) * job.bs;
+    else {
+        req->aiocb.aio_offset = job.offset + bench_next * job.bs;
+        bench_next = (bench_next + 1) % blocks;
+    }
+    req->write = bench_rand() % 100 >= job.rwmix;
+    req->aiocb.is_write = req->write;
+    req->done = 0;
+    req->start = NOW();
+}
+
+static void bench_print(const char *name, struct bench_stats *stats, s_time_t elapsed)
+{
+    static const unsigned pct[] = { 500, 900, 990, 999 };
+    uint64_t ms = elapsed / 1000000;
+    uint64_t kbps, count = 0, total = stats->ops + stats->errors;
+    unsigned b, p = 0;
+
+    if (!total)
+        return;
+    if (!ms)
+        ms = 1;
+    kbps = stats->bytes * 1000 / 1024 / ms;
+    printk("%s: %llu IOPS, %llu.%02llu MB/s, %llu errors\n", name,
+            stats->ops * 1000 / ms, kbps / 1024, (kbps % 1024) * 100 / 1024,
+            stats->errors);
+
+    printk("  latency:");
+    for (b = 0; b < LAT_BUCKETS && p < ARRAY_SIZE(pct); b++) {
+        count += stats->lat_hist[b];
+        while (p < ARRAY_SIZE(pct) && count * 1000 >= total * pct[p]) {
+            printk(" p%u.%u=%lluus", pct[p] / 10, pct[p] % 10, lat_value(b) / 1000);
+            p++;
+        }
+    }
+    printk(" max=%lluus\n", stats->lat_max / 1000);
+}
+
+static void blkbench_thread(void *p)
+{
+    start_info_t *si = p;
+    struct blkfront_aiocb *batch[BENCH_MAX_DEPTH];
+    s_time_t start, now, end;
+    uint64_t dev_size;
+    unsigned i, n;
+    unsigned long flags;
+    DEFINE_WAIT(w);
+
+    parse_job((const char *) si->cmd_line);
+
+    bench_dev = init_blkfront(NULL, &bench_info);
+    if (!bench_dev)
+        return;
+    dev_size = bench_info.sectors * bench_info.sector_size;
+
+    if (job.rwmix > 100)
+        job.rwmix = 100;
+    if (job.rwmix < 100 && bench_info.mode != O_RDWR) {
+        printk("blkbench: read-only device, only reading\n");
+        job.rwmix = 100;
+    }
+    if (!job.depth)
+        job.depth = 1;
+    if (job.depth > BENCH_MAX_DEPTH)
+        job.depth = BENCH_MAX_DEPTH;
+    if (!job.size || job.offset + job.size > dev_size)
+        job.size = job.offset < dev_size ? dev_size - job.offset : 0;
+    if (!job.bs || job.bs % bench_info.sector_size || job.offset % bench_info.sector_size
+            || job.size < job.bs) {
+        printk("blkbench: bad job: bs=%u offset=%llu size=%llu, sector size %u\n",
+                job.bs, job.offset, job.size, bench_info.sector_size);
+        goto out;
+    }
+
+    if (job.bs % bench_info.physical_sector_size || job.offset % bench_info.physical_sector_size)
+        printk("blkbench: warning: not aligned on the %u bytes physical sectors\n",
+                bench_info.physical_sector_size);
+    printk("blkbench: %s %u%% reads, bs=%u iodepth=%u runtime=%us on %llu bytes at %llu\n",
+            job.random ? "random" : "sequential", job.rwmix, job.bs, job.depth,
+            job.runtime, job.size, job.offset);
+
+    for (i = 0; i < job.depth; i++) {
+        struct blkfront_aiocb *aiocb = &bench_reqs[i].aiocb;
+
+        aiocb->aio_dev = bench_dev;
+        aiocb->aio_buf = _xmalloc(job.bs, PAGE_SIZE);
+        memset(aiocb->aio_buf, 0xa5, job.bs);
+        aiocb->aio_nbytes = job.bs;
+        aiocb->aio_cb = bench_completed;
+        aiocb->data = &bench_reqs[i];
+        bench_reqs[i].done = 1;
+    }
+    bench_done = job.depth;
+    blkfront_reset_iostat(bench_dev);
+
+    start = NOW();
+    end = start + SECONDS(job.runtime);
+    while (1) {
+        now = NOW();
+        /* Resubmit everything that completed in one batch */
+        if (bench_done && now < end) {
+            for (i = n = 0; i < job.depth; i++)
+                if (bench_reqs[i].done) {
+                    bench_prepare(&bench_reqs[i]);
+                    batch[n++] = &bench_reqs[i].aiocb;
+                }
+            bench_done = 0;
+            bench_inflight += n;
+            blkfront_aio_submit(bench_dev, batch, n);
+        }
+        if (now >= end && !bench_inflight)
+            break;
+
+        local_irq_save(flags);
+        blkfront_aio_poll(bench_dev);
+        if (!bench_done) {
+            add_waiter(w, blkfront_queue);
+            local_irq_restore(flags);
+            schedule();
+            remove_waiter(w, blkfront_queue);
+        } else
+            local_irq_restore(flags);
+    }
+    now = NOW();
+
+    bench_print("read", &bench_stats[0], now - start);
+    bench_print("write", &bench_stats[1], now - start);
+    blkfront_dump_iostat(bench_dev);
+
+    for (i = 0; i < job.depth; i++)
+        xfree(bench_reqs[i].aiocb.aio_buf);
+out:
+    shutdown_blkfront(bench_dev);
+    bench_dev = NULL;
+}
+
+int app_main(start_info_t *si)
+{
+    printk("Block benchmark: start_info=%p\n", si);
+    create_thread("blkbench", blkbench_thread, si);
+    return 0;
+}
+
+void shutdown_frontends(void)
+{
+    if (bench_dev)
+        shutdown_blkfront(bench_dev);
+}
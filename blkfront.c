@@ -7,6 +7,7 @@
 #include <mini-os/os.h>
 #include <mini-os/xenbus.h>
 #include <mini-os/events.h>
+#include <mini-os/hypervisor.h>
 #include <errno.h>
 #include <xen/io/blkif.h>
 #include <xen/io/protocols.h>
@@ -16,15 +17,18 @@
 #include <mini-os/blkfront.h>
 #include <mini-os/lib.h>
 #include <fcntl.h>
+#include <mini-os/err.h>
 
 #ifndef HAVE_LIBC
 #define strtoul simple_strtoul
+#define strtoull simple_strtoull
 #endif
 
 /* Note: we generally don't need to disable IRQs since we hardly do anything in
  * the interrupt handler.  */
 
-/* Note: we really suppose non-preemptive threads.  */
+/* Note: threads may be preempted with CONFIG_PREEMPT, so the rings and the
+ * shared lists are only changed with events disabled.  */
 
 DECLARE_WAIT_QUEUE_HEAD(blkfront_queue);
 
@@ -32,14 +36,49 @@ DECLARE_WAIT_QUEUE_HEAD(blkfront_queue);
 
 
 #define BLK_RING_SIZE __RING_SIZE((struct blkif_sring *)0, PAGE_SIZE)
+/* The ring always counts in 512-byte sectors, whatever the sector size of
+ * the device.  */
+#define BLKIF_SECTOR_SHIFT 9
 #define GRANT_INVALID_REF 0
 
+#define BLKFRONT_RA_CHUNK_ORDER 3
+#define BLKFRONT_RA_CHUNK_SIZE (PAGE_SIZE << BLKFRONT_RA_CHUNK_ORDER)
+#define BLKFRONT_RA_DEFAULT (128 * 1024)
+
+#define BLKFRONT_BOUNCE_PAGES 16
+
 
 struct blk_buffer {
     void* page;
     grant_ref_t gref;
 };
 
+/* Readahead chunk */
+struct blkfront_ra_chunk {
+    struct blkfront_aiocb aiocb;
+    uint8_t *buf;
+    uint64_t offset;
+    /* 0 when the chunk is free */
+    unsigned len;
+    int inflight;
+    /* Overwritten while in flight, drop on completion */
+    int stale;
+    int used;
+};
+
+struct blkfront_ra {
+    /* In chunks, 0 disables readahead */
+    unsigned max;
+    unsigned window;
+    struct blkfront_ra_chunk *chunks;
+    /* Where the current stream should continue */
+    uint64_t next;
+    /* Where readahead stopped */
+    uint64_t ahead;
+    int stream;
+    struct blkfront_readahead_stats stats;
+};
+
 struct blkfront_dev {
     domid_t dom;
 
@@ -53,6 +92,33 @@ struct blkfront_dev {
     struct blkfront_info info;
 
     xenbus_event_queue events;
+    /* Woken when responses free slots of a full ring */
+    struct wait_queue_head slot_queue;
+    /* Woken for threads waiting for requests other than their own, see
+     * blkfront_wait_count */
+    struct wait_queue_head io_queue;
+
+    struct blkfront_cache *cache;
+    struct blkfront_ra ra;
+
+    /* Pool of pre-granted pages for unaligned I/O */
+    struct blk_buffer *bounce;
+    int bounce_free[BLKFRONT_BOUNCE_PAGES];
+    int nr_bounce_free;
+    /* Bounced writes being read-modify-written */
+    MINIOS_TAILQ_HEAD(, struct blkfront_bounce_req) rmw;
+    /* Bounced pieces waiting for pages, or for the read-modify-writes of
+     * their sectors, in order, see blkfront_bounce_start */
+    MINIOS_TAILQ_HEAD(, struct blkfront_bounce_req) bounce_wait;
+    int bounce_starting;
+    /* Writes in flight, see blkfront_write_begin */
+    MINIOS_TAILQ_HEAD(, struct blkfront_aiocb) writes;
+
+    struct blkfront_iostat iostat;
+    /* Periodic dumps */
+    s_time_t iostat_interval;
+    struct thread *iostat_thread;
+    struct wait_queue_head iostat_queue;
 
 #ifdef HAVE_LIBC
     int fd;
@@ -61,20 +127,53 @@ struct blkfront_dev {
 
 void blkfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
-#ifdef HAVE_LIBC
     struct blkfront_dev *dev = data;
+    RING_IDX rp, cons;
+    int others = 0;
+#ifdef HAVE_LIBC
     int fd = dev->fd;
 
     if (fd != -1)
         files[fd].read = 1;
 #endif
+
+    /* Wake only the threads waiting for the requests that completed.  The
+     * responses are left for them to consume.  */
+    rp = dev->ring.sring->rsp_prod;
+    rmb(); /* Ensure we see queued responses up to 'rp'. */
+    for (cons = dev->ring.rsp_cons; cons != rp; cons++) {
+        struct blkfront_aiocb *aiocbp;
+
+        aiocbp = (void*) (uintptr_t) RING_GET_RESPONSE(&dev->ring, cons)->id;
+        if (aiocbp->waiter)
+            wake(aiocbp->waiter);
+        else
+            others = 1;
+    }
+
+    /* Nobody waits for a slot unless the ring is full */
+    if (dev->ring.rsp_cons != rp && RING_FULL(&dev->ring))
+        wake_up(&dev->slot_queue);
+    if (others)
+        wake_up(&dev->io_queue);
     wake_up(&blkfront_queue);
 }
 
+static void blkfront_cache_free(struct blkfront_dev *dev);
+static void blkfront_ra_free(struct blkfront_dev *dev);
+static void blkfront_bounce_free(struct blkfront_dev *dev);
+
 static void free_blkfront(struct blkfront_dev *dev)
 {
     mask_evtchn(dev->evtchn);
 
+    if (dev->cache)
+        blkfront_cache_free(dev);
+    if (dev->ra.chunks)
+        blkfront_ra_free(dev);
+    if (dev->bounce)
+        blkfront_bounce_free(dev);
+
     free(dev->backend);
 
     gnttab_end_access(dev->ring_ref);
@@ -106,6 +205,13 @@ struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
     dev = malloc(sizeof(*dev));
     memset(dev, 0, sizeof(*dev));
     dev->nodename = strdup(nodename);
+    init_waitqueue_head(&dev->slot_queue);
+    init_waitqueue_head(&dev->io_queue);
+    init_waitqueue_head(&dev->iostat_queue);
+    MINIOS_TAILQ_INIT(&dev->rmw);
+    MINIOS_TAILQ_INIT(&dev->bounce_wait);
+    MINIOS_TAILQ_INIT(&dev->writes);
+    dev->ra.max = BLKFRONT_RA_DEFAULT / BLKFRONT_RA_CHUNK_SIZE;
 #ifdef HAVE_LIBC
     dev->fd = -1;
 #endif
@@ -189,7 +295,8 @@ done:
 
     {
         XenbusState state;
-        char path[strlen(dev->backend) + 1 + 19 + 1];
+        int val;
+        char path[strlen(dev->backend) + 1 + 20 + 1];
         snprintf(path, sizeof(path), "%s/mode", dev->backend);
         msg = xenbus_read(XBT_NIL, path, &c);
         if (msg) {
@@ -219,12 +326,27 @@ done:
         snprintf(path, sizeof(path), "%s/info", dev->backend);
         dev->info.info = xenbus_read_integer(path);
 
-        snprintf(path, sizeof(path), "%s/sectors", dev->backend);
-        // FIXME: read_integer returns an int, so disk size limited to 1TB for now
-        dev->info.sectors = xenbus_read_integer(path);
-
         snprintf(path, sizeof(path), "%s/sector-size", dev->backend);
-        dev->info.sector_size = xenbus_read_integer(path);
+        val = xenbus_read_integer(path);
+        dev->info.sector_size = val > 0 ? val : 512;
+
+        snprintf(path, sizeof(path), "%s/physical-sector-size", dev->backend);
+        val = xenbus_read_integer(path);
+        dev->info.physical_sector_size = val > (int) dev->info.sector_size ?
+            val : dev->info.sector_size;
+
+        /* In 512-byte units, turned into logical sectors for our users */
+        snprintf(path, sizeof(path), "%s/sectors", dev->backend);
+        msg = xenbus_read(XBT_NIL, path, &c);
+        if (msg) {
+            printk("Error %s when reading the size of the device\n", msg);
+            free(msg);
+            msg = NULL;
+        } else {
+            dev->info.sectors = (strtoull(c, NULL, 10) << BLKIF_SECTOR_SHIFT)
+                / dev->info.sector_size;
+            free(c);
+        }
 
         snprintf(path, sizeof(path), "%s/feature-barrier", dev->backend);
         dev->info.barrier = xenbus_read_integer(path);
@@ -232,11 +354,31 @@ done:
         snprintf(path, sizeof(path), "%s/feature-flush-cache", dev->backend);
         dev->info.flush = xenbus_read_integer(path);
 
+        snprintf(path, sizeof(path), "%s/feature-discard", dev->backend);
+        dev->info.discard = xenbus_read_integer(path) == 1;
+        if (dev->info.discard) {
+            snprintf(path, sizeof(path), "%s/discard-granularity", dev->backend);
+            val = xenbus_read_integer(path);
+            dev->info.discard_granularity = val > 0 ? val : dev->info.sector_size;
+
+            snprintf(path, sizeof(path), "%s/discard-alignment", dev->backend);
+            val = xenbus_read_integer(path);
+            dev->info.discard_alignment = val > 0 ? val : 0;
+
+            snprintf(path, sizeof(path), "%s/discard-secure", dev->backend);
+            dev->info.discard_secure = xenbus_read_integer(path) == 1;
+        }
+
         *info = dev->info;
     }
     unmask_evtchn(dev->evtchn);
 
-    printk("%u sectors of %u bytes\n", dev->info.sectors, dev->info.sector_size);
+    printk("%llu sectors of %u bytes (%u physical)\n", (unsigned long long) dev->info.sectors,
+            dev->info.sector_size, dev->info.physical_sector_size);
+    if (dev->info.discard)
+        printk("discard granularity %u alignment %u%s\n",
+                dev->info.discard_granularity, dev->info.discard_alignment,
+                dev->info.discard_secure ? " secure" : "");
     printk("**************************\n");
 
     return dev;
@@ -256,7 +398,9 @@ void shutdown_blkfront(struct blkfront_dev *dev)
     char path[strlen(dev->backend) + 1 + 5 + 1];
     char nodename[strlen(dev->nodename) + 1 + 5 + 1];
 
-    blkfront_sync(dev);
+    blkfront_set_iostat_interval(dev, 0);
+    if (blkfront_sync(dev))
+        printk("shutdown_blkfront: %s could not be synced\n", dev->nodename);
 
     printk("close blk: backend=%s node=%s\n", dev->backend, dev->nodename);
 
@@ -302,246 +446,2806 @@ close:
     xenbus_rm(XBT_NIL, path);
     snprintf(path, sizeof(path), "%s/event-channel", nodename);
     xenbus_rm(XBT_NIL, path);
+    snprintf(path, sizeof(path), "%s/iostat", nodename);
+    xenbus_rm(XBT_NIL, path);
 
     if (!err)
         free_blkfront(dev);
 }
 
-static void blkfront_wait_slot(struct blkfront_dev *dev)
+/* Make queued requests visible to the backend */
+static void blkfront_push(struct blkfront_dev *dev)
 {
-    /* Wait for a slot */
-    if (RING_FULL(&dev->ring)) {
-	unsigned long flags;
-	DEFINE_WAIT(w);
+    int notify;
+
+    wmb();
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
+
+    if(notify) notify_remote_via_evtchn(dev->evtchn);
+}
+
+/* Wait for a free slot on the ring.  Returns with events disabled in
+ * *flags: the slot at req_prod_pvt is ours until they get restored, which
+ * must be done only once req_prod_pvt has been advanced, and nothing that may
+ * sleep can be done meanwhile, as another thread would take the same slot.  */
+static void blkfront_wait_slot(struct blkfront_dev *dev, unsigned long *flags)
+{
+    DEFINE_WAIT(w);
+
+    local_irq_save(*flags);
+    if (!RING_FULL(&dev->ring))
+        return;
+
+    /* Requests may have been queued without being pushed yet */
+    blkfront_push(dev);
+    while (1) {
+	blkfront_aio_poll(dev);
+	if (!RING_FULL(&dev->ring))
+	    break;
+	/* Really no slot, go to sleep. */
+	add_waiter(w, dev->slot_queue);
+	local_irq_restore(*flags);
+	schedule();
+	local_irq_save(*flags);
+    }
+    remove_waiter(w, dev->slot_queue);
+}
+
+/* Poll the ring and sleep until *count drops to zero.  For state changed by
+ * other threads or by requests without a waiter, which wake io_queue.  */
+static void blkfront_wait_count(struct blkfront_dev *dev, int *count)
+{
+    unsigned long flags;
+    DEFINE_WAIT(w);
+
+    blkfront_push(dev);
+    local_irq_save(flags);
+    while (1) {
+	blkfront_aio_poll(dev);
+	if (!*count)
+	    break;
+
+	add_waiter(w, dev->io_queue);
+	local_irq_restore(flags);
+	schedule();
 	local_irq_save(flags);
-	while (1) {
-	    blkfront_aio_poll(dev);
-	    if (!RING_FULL(&dev->ring))
-		break;
-	    /* Really no slot, go to sleep. */
-	    add_waiter(w, blkfront_queue);
-	    local_irq_restore(flags);
-	    schedule();
-	    local_irq_save(flags);
-	}
-	remove_waiter(w, blkfront_queue);
+    }
+    remove_waiter(w, dev->io_queue);
+    local_irq_restore(flags);
+}
+
+/* Poll the ring and sleep until *count drops to zero, for requests queued
+ * with the current thread as waiter: only their completion wakes it up.  */
+static void blkfront_wait_own(struct blkfront_dev *dev, int *count)
+{
+    unsigned long flags;
+
+    blkfront_push(dev);
+    local_irq_save(flags);
+    while (1) {
+	blkfront_aio_poll(dev);
+	if (!*count)
+	    break;
+
+	block(current);
 	local_irq_restore(flags);
+	schedule();
+	local_irq_save(flags);
     }
+    local_irq_restore(flags);
 }
 
-/* Issue an aio */
-void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
+/* I/O statistics */
+static unsigned blkfront_stat_bucket(uint64_t v, unsigned nr)
 {
-    struct blkfront_dev *dev = aiocbp->aio_dev;
-    struct blkif_request *req;
-    RING_IDX i;
-    int notify;
-    int n, j;
-    uintptr_t start, end;
+    unsigned b = 0;
 
-    // Can't io at non-sector-aligned location
-    ASSERT(!(aiocbp->aio_offset & (dev->info.sector_size-1)));
-    // Can't io non-sector-sized amounts
-    ASSERT(!(aiocbp->aio_nbytes & (dev->info.sector_size-1)));
-    // Can't io non-sector-aligned buffer
-    ASSERT(!((uintptr_t) aiocbp->aio_buf & (dev->info.sector_size-1)));
+    while (v >>= 1)
+        b++;
+    return b < nr ? b : nr - 1;
+}
 
-    start = (uintptr_t)aiocbp->aio_buf & PAGE_MASK;
-    end = ((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes + PAGE_SIZE - 1) & PAGE_MASK;
-    aiocbp->n = n = (end - start) / PAGE_SIZE;
+static struct blkfront_op_stats *blkfront_stat_op(struct blkfront_dev *dev, uint8_t op)
+{
+    switch (op) {
+    case BLKIF_OP_READ:
+        return &dev->iostat.op[BLKFRONT_STAT_READ];
+    case BLKIF_OP_WRITE:
+        return &dev->iostat.op[BLKFRONT_STAT_WRITE];
+    case BLKIF_OP_DISCARD:
+        return &dev->iostat.op[BLKFRONT_STAT_DISCARD];
+    default:
+        return &dev->iostat.op[BLKFRONT_STAT_FLUSH];
+    }
+}
 
-    /* qemu's IDE max multsect is 16 (8KB) and SCSI max DMA was set to 32KB,
-     * so max 44KB can't happen */
-    ASSERT(n <= BLKIF_MAX_SEGMENTS_PER_REQUEST);
+/* Account a request just queued on the ring.  Every request carries an
+ * aiocb, where its submission time is kept.  */
+static void blkfront_stat_submit(struct blkfront_dev *dev, struct blkfront_aiocb *aiocbp,
+        uint8_t op, uint64_t bytes)
+{
+    struct blkfront_iostat *stat = &dev->iostat;
+    struct blkfront_op_stats *opstat = blkfront_stat_op(dev, op);
+    unsigned depth = dev->ring.req_prod_pvt - dev->ring.rsp_cons;
 
-    blkfront_wait_slot(dev);
-    i = dev->ring.req_prod_pvt;
-    req = RING_GET_REQUEST(&dev->ring, i);
+    opstat->ops++;
+    opstat->bytes += bytes;
 
-    req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
-    req->nr_segments = n;
-    req->handle = dev->handle;
-    req->id = (uintptr_t) aiocbp;
-    req->sector_number = aiocbp->aio_offset / 512;
+    stat->depth_samples++;
+    stat->depth_total += depth;
+    if (depth > stat->depth_max)
+        stat->depth_max = depth;
+    stat->depth_hist[blkfront_stat_bucket(depth, BLKFRONT_DEPTH_BUCKETS)]++;
 
-    for (j = 0; j < n; j++) {
-        req->seg[j].first_sect = 0;
-        req->seg[j].last_sect = PAGE_SIZE / 512 - 1;
-    }
-    req->seg[0].first_sect = ((uintptr_t)aiocbp->aio_buf & ~PAGE_MASK) / 512;
-    req->seg[n-1].last_sect = (((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes - 1) & ~PAGE_MASK) / 512;
-    for (j = 0; j < n; j++) {
-	uintptr_t data = start + j * PAGE_SIZE;
-        if (!write) {
-            /* Trigger CoW if needed */
-            *(char*)(data + (req->seg[j].first_sect << 9)) = 0;
-            barrier();
-        }
-	aiocbp->gref[j] = req->seg[j].gref =
-            gnttab_grant_access(dev->dom, virtual_to_mfn(data), write);
-    }
+    aiocbp->submit_time = NOW();
+}
 
-    dev->ring.req_prod_pvt = i + 1;
+static void blkfront_stat_complete(struct blkfront_dev *dev, struct blkfront_aiocb *aiocbp,
+        uint8_t op, int status)
+{
+    struct blkfront_op_stats *opstat = blkfront_stat_op(dev, op);
+    s_time_t lat = NOW() - aiocbp->submit_time;
+
+    opstat->completed++;
+    if (status != BLKIF_RSP_OKAY)
+        opstat->errors++;
+    opstat->lat_total += lat;
+    if (lat > opstat->lat_max)
+        opstat->lat_max = lat;
+    opstat->lat_hist[blkfront_stat_bucket(lat / 1000, BLKFRONT_LAT_BUCKETS)]++;
+}
 
-    wmb();
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
+/* Completion state of internal I/O */
+struct blkfront_pending {
+    int pending;
+    int error;
+};
 
-    if(notify) notify_remote_via_evtchn(dev->evtchn);
+static void blkfront_pending_cb(struct blkfront_aiocb *aiocbp, int ret)
+{
+    struct blkfront_pending *io = aiocbp->data;
+
+    if (ret)
+        io->error = ret;
+    io->pending--;
+    if (aiocbp->waiter)
+        wake(aiocbp->waiter);
 }
 
-static void blkfront_aio_cb(struct blkfront_aiocb *aiocbp, int ret)
+/*
+ * Writes are tracked from before they update the cache and readahead until
+ * they complete, so that cache fills and readahead issued meanwhile do not
+ * keep the data they overwrite.  The aio callback is diverted to
+ * blkfront_write_done meanwhile.
+ */
+static void blkfront_write_done(struct blkfront_aiocb *aiocbp, int ret)
 {
-    aiocbp->data = (void*) 1;
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    MINIOS_TAILQ_REMOVE(&dev->writes, aiocbp, write_list);
+    local_irq_restore(flags);
+
+    aiocbp->aio_cb = aiocbp->write_cb;
+    if (aiocbp->aio_cb)
+        aiocbp->aio_cb(aiocbp, ret);
 }
 
-void blkfront_io(struct blkfront_aiocb *aiocbp, int write)
+static void blkfront_write_begin(struct blkfront_aiocb *aiocbp)
 {
+    struct blkfront_dev *dev = aiocbp->aio_dev;
     unsigned long flags;
-    DEFINE_WAIT(w);
 
-    ASSERT(!aiocbp->aio_cb);
-    aiocbp->aio_cb = blkfront_aio_cb;
-    blkfront_aio(aiocbp, write);
-    aiocbp->data = NULL;
+    aiocbp->write_cb = aiocbp->aio_cb;
+    aiocbp->aio_cb = blkfront_write_done;
 
     local_irq_save(flags);
-    while (1) {
-	blkfront_aio_poll(aiocbp->aio_dev);
-	if (aiocbp->data)
-	    break;
+    MINIOS_TAILQ_INSERT_TAIL(&dev->writes, aiocbp, write_list);
+    local_irq_restore(flags);
+}
 
-	add_waiter(w, blkfront_queue);
-	local_irq_restore(flags);
-	schedule();
-	local_irq_save(flags);
-    }
-    remove_waiter(w, blkfront_queue);
+/* Whether a write overlapping [offset, end) is in flight */
+static int blkfront_write_inflight(struct blkfront_dev *dev, uint64_t offset, uint64_t end)
+{
+    struct blkfront_aiocb *aiocbp;
+    unsigned long flags;
+    int ret = 0;
+
+    local_irq_save(flags);
+    MINIOS_TAILQ_FOREACH(aiocbp, &dev->writes, write_list)
+        if ((uint64_t) aiocbp->aio_offset < end &&
+                offset < aiocbp->aio_offset + aiocbp->aio_nbytes) {
+            ret = 1;
+            break;
+        }
     local_irq_restore(flags);
+    return ret;
 }
 
-static void blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, uint64_t id)
+/*
+ * Block cache.
+ *
+ * The device is cached in page-sized blocks, found through a hash table on
+ * their byte offset and recycled in LRU order once the memory budget is
+ * exhausted.  Blocks are marked busy while I/O is in flight on their page;
+ * other threads wait for them to settle before using them.  The hash table
+ * and the LRU list are only changed with events disabled, for threads may be
+ * preempted.
+ */
+#define BLKFRONT_CACHE_NONE (~(uint64_t) 0)
+#define BLKFRONT_CACHE_FLUSH_BATCH 16
+
+struct blkfront_cache_block {
+    struct blkfront_cache_block *hash_next;
+    MINIOS_TAILQ_ENTRY(struct blkfront_cache_block) lru;
+    uint64_t offset;
+    uint8_t *page;
+    int dirty;
+    int busy;
+};
+
+struct blkfront_cache {
+    int policy;
+    unsigned long nr_blocks;
+    unsigned long max_blocks;
+    unsigned long hash_mask;
+    struct blkfront_cache_block **hash;
+    /* Least recently used first, unhashed blocks are kept at the front.  */
+    MINIOS_TAILQ_HEAD(, struct blkfront_cache_block) lru;
+    struct blkfront_cache_stats stats;
+};
+
+static unsigned blkfront_cache_len(struct blkfront_dev *dev, uint64_t offset)
 {
-    int i;
-    struct blkif_request *req;
-    int notify;
+    uint64_t size = dev->info.sectors * dev->info.sector_size;
 
-    blkfront_wait_slot(dev);
-    i = dev->ring.req_prod_pvt;
-    req = RING_GET_REQUEST(&dev->ring, i);
-    req->operation = op;
-    req->nr_segments = 0;
-    req->handle = dev->handle;
-    req->id = id;
-    /* Not needed anyway, but the backend will check it */
-    req->sector_number = 0;
-    dev->ring.req_prod_pvt = i + 1;
-    wmb();
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
-    if (notify) notify_remote_via_evtchn(dev->evtchn);
+    return size - offset < PAGE_SIZE ? size - offset : PAGE_SIZE;
 }
 
-void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op)
+static struct blkfront_cache_block **blkfront_cache_bucket(struct blkfront_cache *cache, uint64_t offset)
 {
-    struct blkfront_dev *dev = aiocbp->aio_dev;
-    blkfront_push_operation(dev, op, (uintptr_t) aiocbp);
+    return &cache->hash[(offset >> PAGE_SHIFT) & cache->hash_mask];
 }
 
-void blkfront_sync(struct blkfront_dev *dev)
+static struct blkfront_cache_block *blkfront_cache_find(struct blkfront_cache *cache, uint64_t offset)
 {
+    struct blkfront_cache_block *b;
     unsigned long flags;
-    DEFINE_WAIT(w);
 
-    if (dev->info.mode == O_RDWR) {
-        if (dev->info.barrier == 1)
-            blkfront_push_operation(dev, BLKIF_OP_WRITE_BARRIER, 0);
+    local_irq_save(flags);
+    for (b = *blkfront_cache_bucket(cache, offset); b; b = b->hash_next)
+        if (b->offset == offset)
+            break;
+    local_irq_restore(flags);
+    return b;
+}
 
-        if (dev->info.flush == 1)
-            blkfront_push_operation(dev, BLKIF_OP_FLUSH_DISKCACHE, 0);
-    }
+static void blkfront_cache_hash(struct blkfront_cache *cache, struct blkfront_cache_block *b, uint64_t offset)
+{
+    struct blkfront_cache_block **bucket = blkfront_cache_bucket(cache, offset);
+    unsigned long flags;
 
-    /* Note: This won't finish if another thread enqueues requests.  */
     local_irq_save(flags);
-    while (1) {
-	blkfront_aio_poll(dev);
-	if (RING_FREE_REQUESTS(&dev->ring) == RING_SIZE(&dev->ring))
-	    break;
+    b->offset = offset;
+    b->hash_next = *bucket;
+    *bucket = b;
+    local_irq_restore(flags);
+}
 
-	add_waiter(w, blkfront_queue);
-	local_irq_restore(flags);
-	schedule();
-	local_irq_save(flags);
-    }
-    remove_waiter(w, blkfront_queue);
+static void blkfront_cache_unhash(struct blkfront_cache *cache, struct blkfront_cache_block *b)
+{
+    struct blkfront_cache_block **pb;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    pb = blkfront_cache_bucket(cache, b->offset);
+    while (*pb != b)
+        pb = &(*pb)->hash_next;
+    *pb = b->hash_next;
+    b->offset = BLKFRONT_CACHE_NONE;
+    b->dirty = 0;
     local_irq_restore(flags);
 }
 
-int blkfront_aio_poll(struct blkfront_dev *dev)
+/* Move the block to its place in the LRU list.  */
+static void blkfront_cache_touch(struct blkfront_cache *cache, struct blkfront_cache_block *b)
 {
-    RING_IDX rp, cons;
-    struct blkif_response *rsp;
-    int more;
-    int nr_consumed;
+    unsigned long flags;
 
-moretodo:
-#ifdef HAVE_LIBC
-    if (dev->fd != -1) {
-        files[dev->fd].read = 0;
-        mb(); /* Make sure to let the handler set read to 1 before we start looking at the ring */
-    }
-#endif
+    local_irq_save(flags);
+    MINIOS_TAILQ_REMOVE(&cache->lru, b, lru);
+    if (b->offset == BLKFRONT_CACHE_NONE)
+        MINIOS_TAILQ_INSERT_HEAD(&cache->lru, b, lru);
+    else
+        MINIOS_TAILQ_INSERT_TAIL(&cache->lru, b, lru);
+    local_irq_restore(flags);
+}
 
-    rp = dev->ring.sring->rsp_prod;
-    rmb(); /* Ensure we see queued responses up to 'rp'. */
-    cons = dev->ring.rsp_cons;
+/* Release busy blocks and let other threads have a look at them.  */
+static void blkfront_cache_release(struct blkfront_dev *dev, struct blkfront_cache_block **blocks, int n)
+{
+    int j;
 
-    nr_consumed = 0;
-    while ((cons != rp))
-    {
-        struct blkfront_aiocb *aiocbp;
-        int status;
+    for (j = 0; j < n; j++)
+        blocks[j]->busy = 0;
+    wake_up(&dev->io_queue);
+}
 
-	rsp = RING_GET_RESPONSE(&dev->ring, cons);
-	nr_consumed++;
+/* Queue one request covering blocks of consecutive offsets.  */
+static void blkfront_cache_submit(struct blkfront_dev *dev, struct blkfront_aiocb *aiocbp,
+        struct blkfront_pending *io, struct blkfront_cache_block **blocks, int n, int write)
+{
+    struct blkif_request *req;
+    unsigned long flags;
+    RING_IDX i;
+    uint64_t bytes = 0;
+    int j;
+
+    memset(aiocbp, 0, sizeof(*aiocbp));
+    aiocbp->aio_dev = dev;
+    aiocbp->aio_offset = blocks[0]->offset;
+    aiocbp->data = io;
+    aiocbp->aio_cb = blkfront_pending_cb;
+    aiocbp->waiter = current;
+    aiocbp->n = n;
+    io->pending++;
+
+    /* Granting may sleep, so before taking the slot */
+    for (j = 0; j < n; j++)
+        aiocbp->gref[j] = gnttab_grant_access(dev->dom, virt_to_mfn(blocks[j]->page), write);
+
+    blkfront_wait_slot(dev, &flags);
+    i = dev->ring.req_prod_pvt;
+    req = RING_GET_REQUEST(&dev->ring, i);
 
-        aiocbp = (void*) (uintptr_t) rsp->id;
-        status = rsp->status;
+    req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+    req->nr_segments = n;
+    req->handle = dev->handle;
+    req->id = (uintptr_t) aiocbp;
+    req->sector_number = blocks[0]->offset >> BLKIF_SECTOR_SHIFT;
 
-        if (status != BLKIF_RSP_OKAY)
-            printk("block error %d for op %d\n", status, rsp->operation);
+    for (j = 0; j < n; j++) {
+        req->seg[j].first_sect = 0;
+        req->seg[j].last_sect = (blkfront_cache_len(dev, blocks[j]->offset) >> BLKIF_SECTOR_SHIFT) - 1;
+        req->seg[j].gref = aiocbp->gref[j];
+        bytes += blkfront_cache_len(dev, blocks[j]->offset);
+    }
 
-        switch (rsp->operation) {
-        case BLKIF_OP_READ:
-        case BLKIF_OP_WRITE:
-        {
-            int j;
+    dev->ring.req_prod_pvt = i + 1;
+    blkfront_stat_submit(dev, aiocbp, req->operation, bytes);
+    local_irq_restore(flags);
 
-            for (j = 0; j < aiocbp->n; j++)
-                gnttab_end_access(aiocbp->gref[j]);
+    blkfront_push(dev);
+}
 
-            break;
+/* Write a dirty block back to the device and wait for it.  The block stays
+ * dirty if that fails.  */
+static int blkfront_cache_writeback(struct blkfront_dev *dev, struct blkfront_cache_block *b)
+{
+    struct blkfront_aiocb aiocb;
+    struct blkfront_pending io = { 0, 0 };
+
+    b->busy = 1;
+    blkfront_cache_submit(dev, &aiocb, &io, &b, 1, 1);
+    blkfront_wait_own(dev, &io.pending);
+    if (!io.error) {
+        b->dirty = 0;
+        dev->cache->stats.writebacks++;
+    }
+    blkfront_cache_release(dev, &b, 1);
+    return io.error;
+}
+
+/* Find the block caching offset, waiting for it if it is busy.  */
+static struct blkfront_cache_block *blkfront_cache_lookup(struct blkfront_dev *dev, uint64_t offset)
+{
+    struct blkfront_cache_block *b;
+
+    while ((b = blkfront_cache_find(dev->cache, offset)) && b->busy)
+        blkfront_wait_count(dev, &b->busy);
+    return b;
+}
+
+/*
+ * Get a block for offset, evicting the least recently used one when the
+ * budget is exhausted.  The block is returned hashed and busy, or NULL if
+ * offset got cached meanwhile, or if no block can be evicted and we may not
+ * wait for one, or an ERR_PTR if the victim could not be written back.
+ */
+static struct blkfront_cache_block *blkfront_cache_alloc(struct blkfront_dev *dev, uint64_t offset, int can_wait)
+{
+    struct blkfront_cache *cache = dev->cache;
+    struct blkfront_cache_block *b;
+    unsigned long flags;
+    int ret;
+
+    if (cache->nr_blocks < cache->max_blocks) {
+        b = xmalloc(struct blkfront_cache_block);
+        if (b) {
+            memset(b, 0, sizeof(*b));
+            b->offset = BLKFRONT_CACHE_NONE;
+            b->page = (uint8_t*) alloc_page();
+            if (b->page) {
+                local_irq_save(flags);
+                cache->nr_blocks++;
+                MINIOS_TAILQ_INSERT_HEAD(&cache->lru, b, lru);
+                local_irq_restore(flags);
+            } else {
+                /* Out of memory, stick to what we have.  */
+                free(b);
+                cache->max_blocks = cache->nr_blocks;
+            }
         }
+    }
 
-        case BLKIF_OP_WRITE_BARRIER:
-        case BLKIF_OP_FLUSH_DISKCACHE:
-            break;
+    /* The victim is picked and claimed without other threads running.  */
+    while (1) {
+        local_irq_save(flags);
+        if (blkfront_cache_find(cache, offset)) {
+            local_irq_restore(flags);
+            return NULL;
+        }
 
-        default:
-            printk("unrecognized block operation %d response\n", rsp->operation);
+        MINIOS_TAILQ_FOREACH(b, &cache->lru, lru)
+            if (!b->busy)
+                break;
+
+        if (!b) {
+            b = MINIOS_TAILQ_FIRST(&cache->lru);
+            local_irq_restore(flags);
+            if (!can_wait || !b)
+                return NULL;
+            blkfront_wait_count(dev, &b->busy);
+            continue;
         }
 
-        dev->ring.rsp_cons = ++cons;
-        /* Nota: callback frees aiocbp itself */
-        if (aiocbp && aiocbp->aio_cb)
-            aiocbp->aio_cb(aiocbp, status ? -EIO : 0);
-        if (dev->ring.rsp_cons != cons)
-            /* We reentered, we must not continue here */
+        if (!b->dirty)
             break;
+        /* May sleep, so look again afterwards.  */
+        b->busy = 1;
+        local_irq_restore(flags);
+        ret = blkfront_cache_writeback(dev, b);
+        if (ret)
+            return ERR_PTR(ret);
     }
 
-    RING_FINAL_CHECK_FOR_RESPONSES(&dev->ring, more);
-    if (more) goto moretodo;
+    if (b->offset != BLKFRONT_CACHE_NONE) {
+        blkfront_cache_unhash(cache, b);
+        cache->stats.evictions++;
+    }
+    blkfront_cache_hash(cache, b, offset);
+    b->busy = 1;
+    blkfront_cache_touch(cache, b);
+    local_irq_restore(flags);
+    return b;
+}
 
-    return nr_consumed;
+/*
+ * Read the blocks from offset up to end that are not cached yet, in a single
+ * request.  Returns the first block, released, NULL if it got cached
+ * meanwhile, or an ERR_PTR on errors.  The blocks are not kept in the cache
+ * if they failed to read, or if a write in flight may overwrite them: the
+ * returned block is then unhashed.
+ */
+static struct blkfront_cache_block *blkfront_cache_fill(struct blkfront_dev *dev, uint64_t offset, uint64_t end)
+{
+    struct blkfront_cache *cache = dev->cache;
+    struct blkfront_cache_block *blocks[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct blkfront_cache_block *b;
+    struct blkfront_aiocb aiocb;
+    struct blkfront_pending io = { 0, 0 };
+    uint64_t size = dev->info.sectors * dev->info.sector_size;
+    int n = 0, j, overwritten;
+
+    do {
+        b = blkfront_cache_alloc(dev, offset, n == 0);
+        if (!b || IS_ERR(b))
+            break;
+        blocks[n++] = b;
+        offset += PAGE_SIZE;
+    } while (n < BLKIF_MAX_SEGMENTS_PER_REQUEST && offset < end && offset < size
+            && !blkfront_cache_find(cache, offset));
+
+    if (!n)
+        return b;
+
+    /* Writes issued from now on wait for the busy blocks and update them */
+    overwritten = blkfront_write_inflight(dev, blocks[0]->offset, offset);
+    blkfront_cache_submit(dev, &aiocb, &io, blocks, n, 0);
+    blkfront_wait_own(dev, &io.pending);
+
+    if (io.error || overwritten)
+        for (j = 0; j < n; j++) {
+            blkfront_cache_unhash(cache, blocks[j]);
+            blkfront_cache_touch(cache, blocks[j]);
+        }
+    blkfront_cache_release(dev, blocks, n);
+    if (io.error)
+        return ERR_PTR(io.error);
+    return blocks[0];
+}
+
+/* Drop the blocks overlapping a discarded range.  */
+static void blkfront_cache_discard(struct blkfront_dev *dev, uint64_t offset, uint64_t end)
+{
+    struct blkfront_cache *cache = dev->cache;
+    struct blkfront_cache_block *b;
+    uint64_t base;
+
+    for (base = offset - (offset & (PAGE_SIZE - 1)); base < end; base += PAGE_SIZE) {
+        while ((b = blkfront_cache_lookup(dev, base))) {
+            if (b->dirty && (base < offset || base + blkfront_cache_len(dev, base) > end)) {
+                /* Keep what is outside the range, and the whole block if
+                 * that fails.  */
+                if (blkfront_cache_writeback(dev, b))
+                    break;
+                continue;
+            }
+            blkfront_cache_unhash(cache, b);
+            blkfront_cache_touch(cache, b);
+            break;
+        }
+    }
+}
+
+/* Whether [offset, end) is not yet on the device, or may not be.  */
+static int blkfront_cache_dirty(struct blkfront_dev *dev, uint64_t offset, uint64_t end)
+{
+    struct blkfront_cache_block *b;
+    uint64_t base;
+
+    for (base = offset - (offset & (PAGE_SIZE - 1)); base < end; base += PAGE_SIZE) {
+        b = blkfront_cache_find(dev->cache, base);
+        if (b && (b->dirty || b->busy))
+            return 1;
+    }
+    return 0;
+}
+
+static void blkfront_do_aio(struct blkfront_aiocb *aiocbp, int write);
+static void blkfront_queue_aio(struct blkfront_aiocb *aiocbp, int write);
+
+/* Serve a synchronous request from the cache, returns 0 or a negative
+ * errno value.  */
+static int blkfront_cache_io(struct blkfront_aiocb *aiocbp, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkfront_cache *cache = dev->cache;
+    struct blkfront_cache_block *b;
+    uint64_t offset = aiocbp->aio_offset;
+    uint64_t end = offset + aiocbp->aio_nbytes;
+    uint8_t *buf = aiocbp->aio_buf;
+
+    while (offset < end) {
+        uint64_t base = offset - (offset & (PAGE_SIZE - 1));
+        unsigned skip = offset - base;
+        unsigned len = end - offset < PAGE_SIZE - skip ? end - offset : PAGE_SIZE - skip;
+
+        b = blkfront_cache_lookup(dev, base);
+        if (b)
+            cache->stats.hits++;
+        else if (write && cache->policy == BLKFRONT_CACHE_WRITETHROUGH) {
+            /* The caller writes it through anyway.  */
+            cache->stats.misses++;
+            goto next;
+        } else if (write && !skip && len == blkfront_cache_len(dev, base)) {
+            /* Overwritten as a whole, no need to read it.  */
+            b = blkfront_cache_alloc(dev, base, 1);
+            if (!b)
+                continue;
+            if (IS_ERR(b))
+                return PTR_ERR(b);
+            blkfront_cache_release(dev, &b, 1);
+            cache->stats.misses++;
+        } else {
+            b = blkfront_cache_fill(dev, base, write ? base + PAGE_SIZE : end);
+            if (!b)
+                continue;
+            if (IS_ERR(b))
+                return PTR_ERR(b);
+            cache->stats.misses++;
+        }
+
+        if (write) {
+            memcpy(b->page + skip, buf, len);
+            if (cache->policy != BLKFRONT_CACHE_WRITEBACK)
+                ;
+            else if (b->offset != BLKFRONT_CACHE_NONE)
+                b->dirty = 1;
+            else {
+                /* Not kept in the cache, write this part through.  */
+                struct blkfront_aiocb aiocb;
+                struct blkfront_pending io = { 1, 0 };
+
+                memset(&aiocb, 0, sizeof(aiocb));
+                aiocb.aio_dev = dev;
+                aiocb.aio_buf = buf;
+                aiocb.aio_nbytes = len;
+                aiocb.aio_offset = offset;
+                aiocb.data = &io;
+                aiocb.aio_cb = blkfront_pending_cb;
+                aiocb.waiter = current;
+                blkfront_write_begin(&aiocb);
+                blkfront_do_aio(&aiocb, 1);
+                blkfront_wait_own(dev, &io.pending);
+                if (io.error)
+                    return io.error;
+            }
+        } else
+            memcpy(buf, b->page + skip, len);
+        blkfront_cache_touch(cache, b);
+
+next:
+        offset += len;
+        buf += len;
+    }
+    return 0;
+}
+
+/* Keep the cache coherent with an aio that bypasses it, returns 0 or a
+ * negative errno value.  */
+static int blkfront_cache_aio(struct blkfront_dev *dev, uint64_t offset,
+        uint8_t *buf, size_t nbytes, int write)
+{
+    struct blkfront_cache_block *b;
+    uint64_t end = offset + nbytes;
+    int ret;
+
+    while (offset < end) {
+        uint64_t base = offset - (offset & (PAGE_SIZE - 1));
+        unsigned skip = offset - base;
+        unsigned len = end - offset < PAGE_SIZE - skip ? end - offset : PAGE_SIZE - skip;
+
+        b = blkfront_cache_lookup(dev, base);
+        if (b) {
+            if (write)
+                memcpy(b->page + skip, buf, len);
+            else if (b->dirty && (ret = blkfront_cache_writeback(dev, b)))
+                return ret;
+        }
+
+        offset += len;
+        buf += len;
+    }
+    return 0;
+}
+
+/* Write all dirty blocks back, returns the first error.  Blocks that could
+ * not be written back stay dirty.  */
+static int blkfront_cache_flush(struct blkfront_dev *dev)
+{
+    struct blkfront_cache *cache = dev->cache;
+    struct blkfront_cache_block *blocks[BLKFRONT_CACHE_FLUSH_BATCH];
+    struct blkfront_aiocb aiocb[BLKFRONT_CACHE_FLUSH_BATCH];
+    struct blkfront_pending io[BLKFRONT_CACHE_FLUSH_BATCH];
+    struct blkfront_cache_block *b;
+    unsigned long flags;
+    int n, j, ret = 0;
+
+    while (!ret) {
+        n = 0;
+        local_irq_save(flags);
+        MINIOS_TAILQ_FOREACH(b, &cache->lru, lru) {
+            if (!b->dirty)
+                continue;
+            if (b->busy) {
+                if (n)
+                    continue;
+                break;
+            }
+            b->busy = 1;
+            blocks[n++] = b;
+            if (n == BLKFRONT_CACHE_FLUSH_BATCH)
+                break;
+        }
+        local_irq_restore(flags);
+        if (!n) {
+            if (!b)
+                return 0;
+            /* Wait for the busy block, and have another look.  */
+            blkfront_wait_count(dev, &b->busy);
+            continue;
+        }
+
+        for (j = 0; j < n; j++) {
+            io[j].pending = io[j].error = 0;
+            blkfront_cache_submit(dev, &aiocb[j], &io[j], &blocks[j], 1, 1);
+        }
+        for (j = 0; j < n; j++) {
+            blkfront_wait_own(dev, &io[j].pending);
+            if (io[j].error) {
+                if (!ret)
+                    ret = io[j].error;
+            } else {
+                blocks[j]->dirty = 0;
+                cache->stats.writebacks++;
+            }
+        }
+        blkfront_cache_release(dev, blocks, n);
+    }
+    return ret;
+}
+
+int blkfront_cache_enable(struct blkfront_dev *dev, size_t budget, int policy)
+{
+    struct blkfront_cache *cache;
+    unsigned long hash_size;
+
+    if (dev->cache)
+        return -EBUSY;
+    if (budget < PAGE_SIZE)
+        return -EINVAL;
+
+    cache = xmalloc(struct blkfront_cache);
+    if (!cache)
+        return -ENOMEM;
+    memset(cache, 0, sizeof(*cache));
+    cache->policy = policy;
+    cache->max_blocks = budget / PAGE_SIZE;
+    for (hash_size = 16; hash_size < cache->max_blocks; hash_size <<= 1)
+        ;
+    cache->hash = xmalloc_array(struct blkfront_cache_block *, hash_size);
+    if (!cache->hash) {
+        free(cache);
+        return -ENOMEM;
+    }
+    memset(cache->hash, 0, hash_size * sizeof(*cache->hash));
+    cache->hash_mask = hash_size - 1;
+    MINIOS_TAILQ_INIT(&cache->lru);
+
+    dev->cache = cache;
+    printk("blkfront: %lu KB %s cache for %s\n", budget / 1024,
+            policy == BLKFRONT_CACHE_WRITEBACK ? "write-back" : "write-through",
+            dev->nodename);
+    return 0;
+}
+
+static void blkfront_cache_free(struct blkfront_dev *dev)
+{
+    struct blkfront_cache *cache = dev->cache;
+    struct blkfront_cache_block *b;
+
+    while ((b = MINIOS_TAILQ_FIRST(&cache->lru))) {
+        MINIOS_TAILQ_REMOVE(&cache->lru, b, lru);
+        free_page(b->page);
+        free(b);
+    }
+    free(cache->hash);
+    free(cache);
+    dev->cache = NULL;
+}
+
+int blkfront_cache_disable(struct blkfront_dev *dev)
+{
+    int ret;
+
+    if (!dev->cache)
+        return 0;
+    ret = blkfront_cache_flush(dev);
+    if (ret)
+        return ret;
+    blkfront_cache_free(dev);
+    return 0;
+}
+
+void blkfront_cache_get_stats(struct blkfront_dev *dev, struct blkfront_cache_stats *stats)
+{
+    if (dev->cache)
+        *stats = dev->cache->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+/*
+ * Readahead.
+ *
+ * Synchronous reads that follow each other are detected as a stream, and the
+ * data after them is read asynchronously into chunks, from which the next
+ * reads are served.  The window doubles each time readahead gets used, and
+ * halves each time it gets thrown away unused.
+ */
+static void blkfront_ra_cb(struct blkfront_aiocb *aiocbp, int ret)
+{
+    struct blkfront_ra_chunk *chunk = aiocbp->data;
+
+    if (ret || chunk->stale)
+        chunk->len = 0;
+    chunk->stale = 0;
+    chunk->inflight = 0;
+    wake_up(&aiocbp->aio_dev->io_queue);
+}
+
+static int blkfront_ra_alloc(struct blkfront_dev *dev)
+{
+    struct blkfront_ra *ra = &dev->ra;
+    unsigned i;
+
+    ra->chunks = xmalloc_array(struct blkfront_ra_chunk, ra->max);
+    if (!ra->chunks)
+        return -ENOMEM;
+    memset(ra->chunks, 0, ra->max * sizeof(*ra->chunks));
+    for (i = 0; i < ra->max; i++) {
+        ra->chunks[i].buf = (uint8_t*) alloc_pages(BLKFRONT_RA_CHUNK_ORDER);
+        if (!ra->chunks[i].buf)
+            break;
+    }
+    if (!i) {
+        free(ra->chunks);
+        ra->chunks = NULL;
+        return -ENOMEM;
+    }
+    ra->max = i;
+    ra->window = 1;
+    return 0;
+}
+
+/* Wait for readahead in flight and release the chunks.  */
+static void blkfront_ra_free(struct blkfront_dev *dev)
+{
+    struct blkfront_ra *ra = &dev->ra;
+    unsigned i;
+
+    for (i = 0; i < ra->max; i++) {
+        blkfront_wait_count(dev, &ra->chunks[i].inflight);
+        free_pages(ra->chunks[i].buf, BLKFRONT_RA_CHUNK_ORDER);
+    }
+    free(ra->chunks);
+    ra->chunks = NULL;
+}
+
+/* Throw a chunk away, returns whether it was not used at all.  */
+static int blkfront_ra_drop(struct blkfront_ra_chunk *chunk)
+{
+    int wasted = 0;
+
+    if (chunk->inflight)
+        chunk->stale = 1;
+    else if (chunk->len) {
+        wasted = !chunk->used;
+        chunk->len = 0;
+    }
+    return wasted;
+}
+
+/* The stream was broken, drop its readahead.  */
+static void blkfront_ra_reset(struct blkfront_dev *dev)
+{
+    struct blkfront_ra *ra = &dev->ra;
+    int wasted = 0;
+    unsigned i;
+
+    for (i = 0; i < ra->max; i++)
+        wasted += blkfront_ra_drop(&ra->chunks[i]);
+    if (wasted) {
+        ra->stats.wasted += wasted;
+        if (ra->window > 1)
+            ra->window /= 2;
+    }
+    ra->ahead = 0;
+}
+
+/* Drop readahead overlapping with a write or discard.  */
+static void blkfront_ra_invalidate(struct blkfront_dev *dev, uint64_t offset, uint64_t end)
+{
+    struct blkfront_ra *ra = &dev->ra;
+    struct blkfront_ra_chunk *chunk;
+    unsigned i;
+
+    if (!ra->chunks)
+        return;
+    for (i = 0; i < ra->max; i++) {
+        chunk = &ra->chunks[i];
+        if (chunk->len && chunk->offset < end && offset < chunk->offset + chunk->len) {
+            chunk->used = 1;
+            blkfront_ra_drop(chunk);
+        }
+    }
+}
+
+static struct blkfront_ra_chunk *blkfront_ra_find(struct blkfront_dev *dev, uint64_t offset)
+{
+    struct blkfront_ra *ra = &dev->ra;
+    struct blkfront_ra_chunk *chunk;
+    unsigned i;
+
+    for (i = 0; i < ra->max; i++) {
+        chunk = &ra->chunks[i];
+        if (chunk->len && !chunk->stale &&
+                chunk->offset <= offset && offset < chunk->offset + chunk->len)
+            return chunk;
+    }
+    return NULL;
+}
+
+/* Fill the window ahead of the stream.  */
+static void blkfront_ra_issue(struct blkfront_dev *dev)
+{
+    struct blkfront_ra *ra = &dev->ra;
+    struct blkfront_ra_chunk *chunk;
+    uint64_t size = dev->info.sectors * dev->info.sector_size;
+    uint64_t limit = ra->next + (uint64_t) ra->window * BLKFRONT_RA_CHUNK_SIZE;
+    unsigned i, len;
+
+    if (!ra->chunks)
+        return;
+
+    /* Recycle what the stream went past.  */
+    for (i = 0; i < ra->max; i++) {
+        chunk = &ra->chunks[i];
+        if (chunk->len && !chunk->inflight && chunk->offset + chunk->len <= ra->next)
+            chunk->len = 0;
+    }
+
+    if (ra->ahead < ra->next)
+        ra->ahead = ra->next & ~((uint64_t) dev->info.sector_size - 1);
+
+    while (ra->ahead < limit && ra->ahead < size) {
+        /* Readahead is not worth waiting for a slot.  */
+        if (RING_FULL(&dev->ring))
+            break;
+        for (i = 0; i < ra->max; i++)
+            if (!ra->chunks[i].len && !ra->chunks[i].inflight)
+                break;
+        if (i == ra->max)
+            break;
+
+        len = size - ra->ahead < BLKFRONT_RA_CHUNK_SIZE ? size - ra->ahead : BLKFRONT_RA_CHUNK_SIZE;
+        /* It could read what is being overwritten, try again later.  Writes
+         * issued from now on drop the chunk, see blkfront_ra_invalidate.  */
+        if (blkfront_write_inflight(dev, ra->ahead, ra->ahead + len))
+            break;
+
+        chunk = &ra->chunks[i];
+        chunk->offset = ra->ahead;
+        chunk->len = len;
+        chunk->used = 0;
+        chunk->stale = 0;
+        chunk->inflight = 1;
+        ra->ahead += chunk->len;
+
+        memset(&chunk->aiocb, 0, sizeof(chunk->aiocb));
+        chunk->aiocb.aio_dev = dev;
+        chunk->aiocb.aio_buf = chunk->buf;
+        chunk->aiocb.aio_nbytes = chunk->len;
+        chunk->aiocb.aio_offset = chunk->offset;
+        chunk->aiocb.data = chunk;
+        chunk->aiocb.aio_cb = blkfront_ra_cb;
+        blkfront_queue_aio(&chunk->aiocb, 0);
+    }
+    blkfront_push(dev);
+}
+
+/* Try to serve a synchronous read from readahead.  */
+static int blkfront_ra_read(struct blkfront_aiocb *aiocbp)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkfront_ra *ra = &dev->ra;
+    struct blkfront_ra_chunk *chunk;
+    uint64_t offset = aiocbp->aio_offset;
+    uint64_t end = offset + aiocbp->aio_nbytes;
+    uint8_t *buf = aiocbp->aio_buf;
+
+    if (offset == ra->next)
+        ra->stream++;
+    else {
+        if (ra->stream && ra->chunks)
+            blkfront_ra_reset(dev);
+        ra->stream = 0;
+    }
+    ra->next = end;
+
+    if (!ra->stream)
+        return 0;
+    if (!ra->chunks && blkfront_ra_alloc(dev)) {
+        /* No memory for it.  */
+        ra->max = 0;
+        return 0;
+    }
+
+    if (dev->cache && blkfront_cache_dirty(dev, offset, end))
+        goto miss;
+
+    while (offset < end) {
+        unsigned len;
+
+        chunk = blkfront_ra_find(dev, offset);
+        if (!chunk)
+            goto miss;
+        if (chunk->inflight) {
+            blkfront_wait_count(dev, &chunk->inflight);
+            continue;
+        }
+
+        len = chunk->offset + chunk->len - offset;
+        if (len > end - offset)
+            len = end - offset;
+        memcpy(buf, chunk->buf + (offset - chunk->offset), len);
+        chunk->used = 1;
+        offset += len;
+        buf += len;
+    }
+
+    ra->stats.hits++;
+    if (ra->window < ra->max)
+        ra->window *= 2;
+    if (ra->window > ra->max)
+        ra->window = ra->max;
+    blkfront_ra_issue(dev);
+    return 1;
+
+miss:
+    ra->stats.misses++;
+    return 0;
+}
+
+int blkfront_set_readahead(struct blkfront_dev *dev, size_t max)
+{
+    struct blkfront_ra *ra = &dev->ra;
+
+    if (ra->chunks)
+        blkfront_ra_free(dev);
+    memset(ra, 0, sizeof(*ra));
+    ra->max = max / BLKFRONT_RA_CHUNK_SIZE;
+    if (max && !ra->max)
+        return -EINVAL;
+    return 0;
+}
+
+void blkfront_get_readahead_stats(struct blkfront_dev *dev, struct blkfront_readahead_stats *stats)
+{
+    *stats = dev->ra.stats;
+    stats->window = dev->ra.window * BLKFRONT_RA_CHUNK_SIZE;
+}
+
+/*
+ * Bounce buffers.
+ *
+ * I/O that is not sector-aligned goes through a small pool of pages which
+ * stay granted to the backend.  Sectors that a write only partly covers are
+ * read first.  Whatever part of the request turns out to be aligned still
+ * goes directly to the caller's buffer.
+ *
+ * Bounced pieces wait in order for their pages and for other writes to the
+ * same sectors, and then run their reads and their I/O from completion
+ * callbacks, so submitting never waits for other requests to complete.
+ */
+#define BLKFRONT_BOUNCE_MAX (BLKIF_MAX_SEGMENTS_PER_REQUEST * PAGE_SIZE)
+
+/* Unaligned aio being served */
+struct blkfront_bounce {
+    struct blkfront_aiocb *parent;
+    /* Pieces in flight, plus one while submitting */
+    int remaining;
+    int ret;
+    /* Whether the parent's buffer is mapped, and pinned for the copies done
+     * on completion */
+    int pinned;
+};
+
+/* Piece of an unaligned aio */
+struct blkfront_bounce_req {
+    struct blkfront_aiocb aiocb;
+    struct blkfront_bounce *bounce;
+    int write;
+    /* The caller's data, and where it starts in the bounce pages */
+    uint8_t *buf;
+    unsigned skip;
+    unsigned len;
+    int nr_pages;
+    int pages[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    /* The I/O on the bounce pages */
+    uint64_t start;
+    unsigned bytes;
+    /* Sectors of ps bytes still to read at the start and at the end */
+    int rmw_head, rmw_tail;
+    unsigned ps;
+    /* Sectors read-modify-written, empty if none, while on dev->rmw */
+    uint64_t rmw_start, rmw_end;
+    int rmw;
+    MINIOS_TAILQ_ENTRY(struct blkfront_bounce_req) rmw_list;
+    MINIOS_TAILQ_ENTRY(struct blkfront_bounce_req) wait_list;
+};
+
+static int blkfront_bounce_init(struct blkfront_dev *dev)
+{
+    struct blk_buffer *bounce;
+    int i;
+
+    bounce = xmalloc_array(struct blk_buffer, BLKFRONT_BOUNCE_PAGES);
+    if (!bounce)
+        return -ENOMEM;
+    for (i = 0; i < BLKFRONT_BOUNCE_PAGES; i++) {
+        bounce[i].page = (void*) alloc_page();
+        if (!bounce[i].page) {
+            while (i--) {
+                gnttab_end_access(bounce[i].gref);
+                free_page(bounce[i].page);
+            }
+            free(bounce);
+            return -ENOMEM;
+        }
+        bounce[i].gref = gnttab_grant_access(dev->dom,
+                virt_to_mfn(bounce[i].page), 0);
+        dev->bounce_free[i] = i;
+    }
+    dev->nr_bounce_free = BLKFRONT_BOUNCE_PAGES;
+    dev->bounce = bounce;
+    return 0;
+}
+
+static void blkfront_bounce_free(struct blkfront_dev *dev)
+{
+    int i;
+
+    for (i = 0; i < BLKFRONT_BOUNCE_PAGES; i++) {
+        gnttab_end_access(dev->bounce[i].gref);
+        free_page(dev->bounce[i].page);
+    }
+    free(dev->bounce);
+    dev->bounce = NULL;
+}
+
+static void blkfront_bounce_put(struct blkfront_dev *dev, int *pages, int n)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    while (n--)
+        dev->bounce_free[dev->nr_bounce_free++] = pages[n];
+    local_irq_restore(flags);
+}
+
+static void blkfront_rmw_unlock(struct blkfront_dev *dev, struct blkfront_bounce_req *req)
+{
+    unsigned long flags;
+
+    if (!req->rmw)
+        return;
+    local_irq_save(flags);
+    MINIOS_TAILQ_REMOVE(&dev->rmw, req, rmw_list);
+    req->rmw = 0;
+    local_irq_restore(flags);
+}
+
+/* Copy between buf and the bounce pages, starting skip bytes in them.  */
+static void blkfront_bounce_copy(struct blkfront_dev *dev, int *pages, unsigned skip,
+        uint8_t *buf, unsigned len, int to_pages)
+{
+    while (len) {
+        uint8_t *page = dev->bounce[pages[skip / PAGE_SIZE]].page;
+        unsigned off = skip & ~PAGE_MASK;
+        unsigned n = PAGE_SIZE - off < len ? PAGE_SIZE - off : len;
+
+        if (to_pages)
+            memcpy(page + off, buf, n);
+        else
+            memcpy(buf, page + off, n);
+        skip += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Queue the I/O of bytes at offset, from or to the bounce pages starting
+ * skip bytes in them.  */
+static void blkfront_bounce_submit(struct blkfront_dev *dev, struct blkfront_aiocb *aiocbp,
+        int *pages, unsigned skip, uint64_t offset, unsigned bytes, int write)
+{
+    struct blkif_request *req;
+    unsigned long flags;
+    RING_IDX i;
+    int n = 0;
+
+    aiocbp->aio_dev = dev;
+    aiocbp->aio_offset = offset;
+    aiocbp->aio_nbytes = bytes;
+    /* The pages stay granted */
+    aiocbp->n = 0;
+    aiocbp->nr_pinned = 0;
+
+    blkfront_wait_slot(dev, &flags);
+    i = dev->ring.req_prod_pvt;
+    req = RING_GET_REQUEST(&dev->ring, i);
+
+    req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+    req->handle = dev->handle;
+    req->id = (uintptr_t) aiocbp;
+    req->sector_number = offset >> BLKIF_SECTOR_SHIFT;
+
+    while (bytes) {
+        unsigned off = skip & ~PAGE_MASK;
+        unsigned len = PAGE_SIZE - off < bytes ? PAGE_SIZE - off : bytes;
+
+        req->seg[n].gref = dev->bounce[pages[skip / PAGE_SIZE]].gref;
+        req->seg[n].first_sect = off >> BLKIF_SECTOR_SHIFT;
+        req->seg[n].last_sect = ((off + len) >> BLKIF_SECTOR_SHIFT) - 1;
+        n++;
+        skip += len;
+        bytes -= len;
+    }
+    req->nr_segments = n;
+
+    dev->ring.req_prod_pvt = i + 1;
+    blkfront_stat_submit(dev, aiocbp, req->operation, aiocbp->aio_nbytes);
+    local_irq_restore(flags);
+
+    blkfront_push(dev);
+}
+
+static void blkfront_bounce_done(struct blkfront_bounce *bounce, int ret)
+{
+    struct blkfront_aiocb *parent = bounce->parent;
+
+    if (ret)
+        bounce->ret = ret;
+    if (--bounce->remaining)
+        return;
+
+    ret = bounce->ret;
+    if (bounce->pinned)
+        blkfront_map_unpin(parent->aio_buf, parent->aio_nbytes);
+    free(bounce);
+    if (parent->aio_cb)
+        parent->aio_cb(parent, ret);
+}
+
+static void blkfront_bounce_start(struct blkfront_dev *dev);
+
+static void blkfront_bounce_cb(struct blkfront_aiocb *aiocbp, int ret)
+{
+    struct blkfront_bounce_req *req = aiocbp->data;
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkfront_bounce *bounce = req->bounce;
+
+    if (!ret && !req->write && req->nr_pages)
+        blkfront_bounce_copy(dev, req->pages, req->skip, req->buf, req->len, 0);
+    if (req->nr_pages) {
+        blkfront_bounce_put(dev, req->pages, req->nr_pages);
+        blkfront_rmw_unlock(dev, req);
+        blkfront_bounce_start(dev);
+    }
+    free(req);
+    blkfront_bounce_done(bounce, ret);
+}
+
+static void blkfront_bounce_step(struct blkfront_bounce_req *req);
+
+static void blkfront_bounce_rmw_cb(struct blkfront_aiocb *aiocbp, int ret)
+{
+    struct blkfront_bounce_req *req = aiocbp->data;
+
+    if (ret)
+        /* Don't clobber what we could not read */
+        blkfront_bounce_cb(aiocbp, ret);
+    else
+        blkfront_bounce_step(req);
+}
+
+/* Next step of a piece that got its pages: read the sectors that a write
+ * only partly covers, one after the other, then queue the I/O itself.  */
+static void blkfront_bounce_step(struct blkfront_bounce_req *req)
+{
+    struct blkfront_dev *dev = req->aiocb.aio_dev;
+
+    req->aiocb.aio_cb = blkfront_bounce_rmw_cb;
+    if (req->rmw_head) {
+        req->rmw_head = 0;
+        blkfront_bounce_submit(dev, &req->aiocb, req->pages, 0, req->start, req->ps, 0);
+    } else if (req->rmw_tail) {
+        req->rmw_tail = 0;
+        blkfront_bounce_submit(dev, &req->aiocb, req->pages, req->bytes - req->ps,
+                req->start + req->bytes - req->ps, req->ps, 0);
+    } else {
+        if (req->write)
+            blkfront_bounce_copy(dev, req->pages, req->skip, req->buf, req->len, 1);
+        req->aiocb.aio_cb = blkfront_bounce_cb;
+        blkfront_bounce_submit(dev, &req->aiocb, req->pages, 0, req->start, req->bytes, req->write);
+    }
+}
+
+/*
+ * Start the pieces waiting on dev->bounce_wait, in order, while there are
+ * enough free pages and no other piece read-modify-writes their sectors.
+ * Otherwise one of them would write back what it read before the other one
+ * wrote.  Called when pieces are queued and when they complete; calls made
+ * meanwhile, from the completions of the requests being queued, are left to
+ * the outer one.
+ */
+static void blkfront_bounce_start(struct blkfront_dev *dev)
+{
+    struct blkfront_bounce_req *req, *r;
+    unsigned long flags;
+    int n;
+
+    local_irq_save(flags);
+    if (dev->bounce_starting) {
+        local_irq_restore(flags);
+        return;
+    }
+    dev->bounce_starting = 1;
+    while ((req = MINIOS_TAILQ_FIRST(&dev->bounce_wait))
+            && dev->nr_bounce_free >= req->nr_pages) {
+        MINIOS_TAILQ_FOREACH(r, &dev->rmw, rmw_list)
+            if (r->rmw_start < req->rmw_end && req->rmw_start < r->rmw_end)
+                break;
+        if (r)
+            break;
+
+        MINIOS_TAILQ_REMOVE(&dev->bounce_wait, req, wait_list);
+        if (req->rmw_start != req->rmw_end) {
+            MINIOS_TAILQ_INSERT_TAIL(&dev->rmw, req, rmw_list);
+            req->rmw = 1;
+        }
+        for (n = req->nr_pages; n--; )
+            req->pages[n] = dev->bounce_free[--dev->nr_bounce_free];
+        local_irq_restore(flags);
+
+        blkfront_bounce_step(req);
+        local_irq_save(flags);
+    }
+    dev->bounce_starting = 0;
+    local_irq_restore(flags);
+}
+
+static void blkfront_bounce_queue(struct blkfront_dev *dev, struct blkfront_bounce_req *req)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    MINIOS_TAILQ_INSERT_TAIL(&dev->bounce_wait, req, wait_list);
+    local_irq_restore(flags);
+    blkfront_bounce_start(dev);
+}
+
+/* Issue an aio that is not sector-aligned, in pieces.  */
+static void blkfront_bounce_aio(struct blkfront_aiocb *aiocbp, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    uint64_t ss = dev->info.sector_size;
+    /* Write whole physical sectors, so the backend does not have to
+     * read-modify-write them again.  */
+    uint64_t ps = write && dev->info.physical_sector_size <= PAGE_SIZE ?
+        dev->info.physical_sector_size : ss;
+    uint64_t offset = aiocbp->aio_offset;
+    uint64_t end = offset + aiocbp->aio_nbytes;
+    uint8_t *buf = aiocbp->aio_buf;
+    struct blkfront_bounce *bounce;
+    struct blkfront_bounce_req *req;
+    int ret;
+
+    bounce = xmalloc(struct blkfront_bounce);
+    if (!bounce) {
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, -ENOMEM);
+        return;
+    }
+    bounce->parent = aiocbp;
+    bounce->remaining = 1;
+    bounce->ret = 0;
+    /* Reads are copied to the buffer on completion, when faults cannot be
+     * served */
+    ret = blkfront_map_pin(buf, aiocbp->aio_nbytes, !write);
+    if (ret < 0) {
+        free(bounce);
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, ret);
+        return;
+    }
+    bounce->pinned = ret > 0;
+
+    while (offset < end) {
+        uint64_t start = offset & ~(ps - 1);
+        /* Whether the buffer gets aligned at the next sector boundary */
+        int direct = !(((uintptr_t) buf - offset) & (ss - 1));
+        unsigned len;
+
+        req = xmalloc(struct blkfront_bounce_req);
+        if (!req) {
+            bounce->ret = -ENOMEM;
+            break;
+        }
+        memset(req, 0, sizeof(*req));
+        req->bounce = bounce;
+        req->write = write;
+        req->aiocb.aio_dev = dev;
+        req->aiocb.data = req;
+        req->aiocb.aio_cb = blkfront_bounce_cb;
+        req->aiocb.waiter = aiocbp->waiter;
+
+        if (direct && offset == start && end - offset >= ps) {
+            /* Zero-copy */
+            len = BLKFRONT_BOUNCE_MAX - ((uintptr_t) buf & ~PAGE_MASK);
+            if (len > end - offset)
+                len = end - offset;
+            len &= ~(ps - 1);
+
+            req->aiocb.aio_buf = buf;
+            req->aiocb.aio_nbytes = len;
+            req->aiocb.aio_offset = offset;
+            bounce->remaining++;
+            blkfront_queue_aio(&req->aiocb, write);
+        } else {
+            uint64_t stop, rend;
+            unsigned bytes;
+
+            /* Only bounce until the direct path can take over */
+            stop = direct ? start + ps : start + BLKFRONT_BOUNCE_MAX;
+            if (stop > end)
+                stop = end;
+            rend = (stop + ps - 1) & ~(ps - 1);
+            bytes = rend - start;
+            len = stop - offset;
+
+            req->buf = buf;
+            req->skip = offset - start;
+            req->len = len;
+            req->start = start;
+            req->bytes = bytes;
+            if (write && (offset != start || stop != rend)) {
+                req->rmw_start = start;
+                req->rmw_end = rend;
+                req->ps = ps;
+                req->rmw_head = offset != start;
+                req->rmw_tail = stop != rend && (rend - ps != start || offset == start);
+            }
+            if (!dev->bounce && blkfront_bounce_init(dev)) {
+                free(req);
+                bounce->ret = -ENOMEM;
+                goto next;
+            }
+            req->nr_pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+            bounce->remaining++;
+            blkfront_bounce_queue(dev, req);
+        }
+
+next:
+        offset += len;
+        buf += len;
+    }
+
+    blkfront_bounce_done(bounce, 0);
+}
+
+/* Number of segments needed to do the I/O zero-copy in one request, or -1 if
+ * that is not possible.  */
+static int blkfront_iov_segments(struct blkfront_dev *dev, const struct blkfront_iov *iov, int iovcnt)
+{
+    int k, n = 0;
+
+    for (k = 0; k < iovcnt; k++) {
+        uintptr_t start, end;
+
+        // Can't io non-sector-aligned buffer or non-sector-sized amounts
+        if (((uintptr_t) iov[k].iov_base | iov[k].iov_len) & (dev->info.sector_size-1))
+            return -1;
+        if (!iov[k].iov_len)
+            continue;
+        start = (uintptr_t)iov[k].iov_base & PAGE_MASK;
+        end = ((uintptr_t)iov[k].iov_base + iov[k].iov_len + PAGE_SIZE - 1) & PAGE_MASK;
+        n += (end - start) / PAGE_SIZE;
+    }
+    if (!n || n > BLKIF_MAX_SEGMENTS_PER_REQUEST)
+        return -1;
+    return n;
+}
+
+static void blkfront_unpin_aio(struct blkfront_aiocb *aiocbp)
+{
+    while (aiocbp->nr_pinned)
+        blkfront_map_unpin(aiocbp->pinned[--aiocbp->nr_pinned], 1);
+}
+
+/* Queue a request with one segment per page of the buffers */
+static void blkfront_queue_segments(struct blkfront_aiocb *aiocbp,
+        const struct blkfront_iov *iov, int iovcnt, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkif_request_segment seg[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    uintptr_t va[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct blkif_request *req;
+    unsigned long flags;
+    RING_IDX i;
+    int n = 0, k, ret;
+    uint64_t bytes = 0;
+
+    /* Faulting pages in and granting them may sleep, so before taking the
+     * slot.  Mapped pages must not be evicted while granted, and must be
+     * resident to get their mfn.  */
+    aiocbp->nr_pinned = 0;
+    for (k = 0; k < iovcnt; k++) {
+        uintptr_t base = (uintptr_t)iov[k].iov_base;
+        uintptr_t start, end, data;
+
+        if (!iov[k].iov_len)
+            continue;
+        bytes += iov[k].iov_len;
+        start = base & PAGE_MASK;
+        end = (base + iov[k].iov_len + PAGE_SIZE - 1) & PAGE_MASK;
+        for (data = start; data < end; data += PAGE_SIZE, n++) {
+            seg[n].first_sect = data == start ? (base & ~PAGE_MASK) >> BLKIF_SECTOR_SHIFT : 0;
+            seg[n].last_sect = data + PAGE_SIZE == end ?
+                ((base + iov[k].iov_len - 1) & ~PAGE_MASK) >> BLKIF_SECTOR_SHIFT :
+                (PAGE_SIZE >> BLKIF_SECTOR_SHIFT) - 1;
+            va[n] = data;
+            ret = blkfront_map_pin((void*) data, 1, !write);
+            if (ret < 0) {
+                blkfront_unpin_aio(aiocbp);
+                aiocbp->n = 0;
+                if (aiocbp->aio_cb)
+                    aiocbp->aio_cb(aiocbp, ret);
+                return;
+            }
+            if (ret)
+                aiocbp->pinned[aiocbp->nr_pinned++] = (void*) data;
+        }
+    }
+    for (k = 0; k < n; k++) {
+        if (!write) {
+            /* Trigger CoW if needed */
+            *(char*)(va[k] + (seg[k].first_sect << BLKIF_SECTOR_SHIFT)) = 0;
+            barrier();
+        }
+        aiocbp->gref[k] = seg[k].gref =
+            gnttab_grant_access(dev->dom, virtual_to_mfn(va[k]), write);
+    }
+    aiocbp->n = n;
+
+    blkfront_wait_slot(dev, &flags);
+    i = dev->ring.req_prod_pvt;
+    req = RING_GET_REQUEST(&dev->ring, i);
+
+    req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+    req->handle = dev->handle;
+    req->id = (uintptr_t) aiocbp;
+    req->sector_number = aiocbp->aio_offset >> BLKIF_SECTOR_SHIFT;
+    req->nr_segments = n;
+    memcpy(req->seg, seg, n * sizeof(seg[0]));
+
+    dev->ring.req_prod_pvt = i + 1;
+    blkfront_stat_submit(dev, aiocbp, req->operation, bytes);
+    local_irq_restore(flags);
+}
+
+/* Queue each buffer of a vectored aio on its own.  Buffers sharing a
+ * sector are bounced, and their read-modify-writes of it run one after the
+ * other, in order, see blkfront_bounce_start.  */
+static void blkfront_iov_split(struct blkfront_aiocb *aiocbp, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    uint64_t offset = aiocbp->aio_offset;
+    struct blkfront_bounce *bounce;
+    struct blkfront_bounce_req *req;
+    int k;
+
+    bounce = xmalloc(struct blkfront_bounce);
+    if (!bounce) {
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, -ENOMEM);
+        return;
+    }
+    bounce->parent = aiocbp;
+    bounce->remaining = 1;
+    bounce->ret = 0;
+    bounce->pinned = 0;
+
+    for (k = 0; k < aiocbp->aio_iovcnt; k++) {
+        req = xmalloc(struct blkfront_bounce_req);
+        if (!req) {
+            bounce->ret = -ENOMEM;
+            break;
+        }
+        memset(req, 0, sizeof(*req));
+        req->bounce = bounce;
+        req->write = write;
+        req->aiocb.aio_dev = dev;
+        req->aiocb.aio_buf = aiocbp->aio_iov[k].iov_base;
+        req->aiocb.aio_nbytes = aiocbp->aio_iov[k].iov_len;
+        req->aiocb.aio_offset = offset;
+        req->aiocb.data = req;
+        req->aiocb.aio_cb = blkfront_bounce_cb;
+        req->aiocb.waiter = aiocbp->waiter;
+        bounce->remaining++;
+        blkfront_queue_aio(&req->aiocb, write);
+        offset += aiocbp->aio_iov[k].iov_len;
+    }
+
+    blkfront_bounce_done(bounce, 0);
+}
+
+/* Queue an aio, bypassing the cache.  Requests are not pushed to the backend
+ * yet.  */
+static void blkfront_queue_aio(struct blkfront_aiocb *aiocbp, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkfront_iov iov, *iovp = &iov;
+    int iovcnt = 1;
+
+    if (aiocbp->aio_buf) {
+        iov.iov_base = aiocbp->aio_buf;
+        iov.iov_len = aiocbp->aio_nbytes;
+    } else {
+        iovp = aiocbp->aio_iov;
+        iovcnt = aiocbp->aio_iovcnt;
+    }
+
+    if (!(aiocbp->aio_offset & (dev->info.sector_size-1))
+            && blkfront_iov_segments(dev, iovp, iovcnt) > 0)
+        blkfront_queue_segments(aiocbp, iovp, iovcnt, write);
+    else if (aiocbp->aio_buf)
+        /* Unaligned, or too big for one request */
+        blkfront_bounce_aio(aiocbp, write);
+    else
+        blkfront_iov_split(aiocbp, write);
+}
+
+/* Issue an aio, bypassing the cache */
+static void blkfront_do_aio(struct blkfront_aiocb *aiocbp, int write)
+{
+    blkfront_queue_aio(aiocbp, write);
+    blkfront_push(aiocbp->aio_dev);
+}
+
+/* Common part of queueing aios for the outside.  Returns 0, or completes
+ * the aio with a negative errno value and returns it.  */
+static int blkfront_aio_prepare(struct blkfront_aiocb *aiocbp, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    uint64_t offset = aiocbp->aio_offset;
+    int k, ret = 0;
+
+    /* Submitting may sleep for a ring slot or a grant entry */
+    ASSERT(!in_callback && !irqs_disabled());
+    aiocbp->waiter = NULL;
+    if (!aiocbp->aio_buf) {
+        aiocbp->aio_nbytes = 0;
+        for (k = 0; k < aiocbp->aio_iovcnt; k++)
+            aiocbp->aio_nbytes += aiocbp->aio_iov[k].iov_len;
+    }
+
+    if (write) {
+        blkfront_write_begin(aiocbp);
+        blkfront_ra_invalidate(dev, offset, offset + aiocbp->aio_nbytes);
+    }
+    if (dev->cache) {
+        if (aiocbp->aio_buf)
+            ret = blkfront_cache_aio(dev, offset, aiocbp->aio_buf, aiocbp->aio_nbytes, write);
+        else
+            for (k = 0; k < aiocbp->aio_iovcnt && !ret; k++) {
+                ret = blkfront_cache_aio(dev, offset, aiocbp->aio_iov[k].iov_base,
+                        aiocbp->aio_iov[k].iov_len, write);
+                offset += aiocbp->aio_iov[k].iov_len;
+            }
+    }
+    if (ret && aiocbp->aio_cb)
+        aiocbp->aio_cb(aiocbp, ret);
+    return ret;
+}
+
+/* Issue an aio */
+void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
+{
+    if (!blkfront_aio_prepare(aiocbp, write))
+        blkfront_do_aio(aiocbp, write);
+}
+
+/* Issue several aios, with only one notification of the backend */
+void blkfront_aio_submit(struct blkfront_dev *dev, struct blkfront_aiocb *aiocbs[], int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        ASSERT(aiocbs[i]->aio_dev == dev);
+        if (!blkfront_aio_prepare(aiocbs[i], aiocbs[i]->is_write))
+            blkfront_queue_aio(aiocbs[i], aiocbs[i]->is_write);
+    }
+    blkfront_push(dev);
+}
+
+/* Issue a discard of the aio_nbytes bytes at aio_offset */
+void blkfront_aio_discard(struct blkfront_aiocb *aiocbp, int secure)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkif_request_discard *req;
+    uint64_t end = aiocbp->aio_offset + aiocbp->aio_nbytes;
+    unsigned long flags;
+    RING_IDX i;
+
+    ASSERT(dev->info.discard);
+    // Can't discard at non-sector-aligned location
+    ASSERT(!(aiocbp->aio_offset & (dev->info.sector_size-1)));
+    // Can't discard non-sector-sized amounts
+    ASSERT(!(aiocbp->aio_nbytes & (dev->info.sector_size-1)));
+
+    blkfront_ra_invalidate(dev, aiocbp->aio_offset, end);
+    if (dev->cache)
+        blkfront_cache_discard(dev, aiocbp->aio_offset, end);
+
+    /* No grant to end on completion */
+    aiocbp->n = 0;
+    aiocbp->waiter = NULL;
+
+    blkfront_wait_slot(dev, &flags);
+    i = dev->ring.req_prod_pvt;
+    req = (struct blkif_request_discard *) RING_GET_REQUEST(&dev->ring, i);
+
+    req->operation = BLKIF_OP_DISCARD;
+    req->flag = secure && dev->info.discard_secure ? BLKIF_DISCARD_SECURE : 0;
+    req->handle = dev->handle;
+    req->id = (uintptr_t) aiocbp;
+    req->sector_number = aiocbp->aio_offset >> BLKIF_SECTOR_SHIFT;
+    req->nr_sectors = aiocbp->aio_nbytes >> BLKIF_SECTOR_SHIFT;
+
+    dev->ring.req_prod_pvt = i + 1;
+    blkfront_stat_submit(dev, aiocbp, BLKIF_OP_DISCARD, aiocbp->aio_nbytes);
+    local_irq_restore(flags);
+
+    blkfront_push(dev);
+}
+
+/* Synchronous I/O, returns 0 or a negative errno value */
+static int blkfront_do_io(struct blkfront_aiocb *aiocbp, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkfront_pending io = { 1, 0 };
+    int ret = 0;
+    /* Whether it goes to the device, rather than only to the cache */
+    int direct = !dev->cache || !aiocbp->aio_buf
+            || (write && dev->cache->policy == BLKFRONT_CACHE_WRITETHROUGH);
+
+    ASSERT(!aiocbp->aio_cb);
+    aiocbp->aio_cb = blkfront_pending_cb;
+    aiocbp->data = &io;
+
+    if (!aiocbp->aio_buf) {
+        /* Vectored, just keep readahead and the cache coherent */
+        if (blkfront_aio_prepare(aiocbp, write))
+            goto out;
+    } else if (write) {
+        if (direct)
+            blkfront_write_begin(aiocbp);
+        blkfront_ra_invalidate(dev, aiocbp->aio_offset,
+                aiocbp->aio_offset + aiocbp->aio_nbytes);
+    } else if (dev->ra.max && blkfront_ra_read(aiocbp))
+        goto out;
+
+    if (dev->cache && aiocbp->aio_buf)
+        ret = blkfront_cache_io(aiocbp, write);
+
+    if (direct && !ret) {
+        /* Only our own completion wakes us up.  */
+        aiocbp->waiter = current;
+        blkfront_do_aio(aiocbp, write);
+        blkfront_wait_own(dev, &io.pending);
+        aiocbp->waiter = NULL;
+    } else
+        /* Nothing in flight, complete it as the backend would */
+        aiocbp->aio_cb(aiocbp, ret);
+
+    /* Get the rest of the stream on its way.  */
+    if (!write && dev->ra.stream)
+        blkfront_ra_issue(dev);
+
+out:
+    aiocbp->aio_cb = NULL;
+    aiocbp->data = NULL;
+    return io.error;
+}
+
+void blkfront_io(struct blkfront_aiocb *aiocbp, int write)
+{
+    blkfront_do_io(aiocbp, write);
+}
+
+/* Positional I/O of any size and alignment, in as many requests as needed,
+ * all in flight at the same time.  Stops at the end of the device.  */
+static ssize_t blkfront_prw(struct blkfront_dev *dev, void *buf, size_t nbytes, off_t offset, int write)
+{
+    struct blkfront_aiocb aiocb;
+    uint64_t size = dev->info.sectors * dev->info.sector_size;
+    int ret;
+
+    if (offset < 0)
+        return -EINVAL;
+    if (write && dev->info.mode != O_RDWR)
+        return -EBADF;
+    if (offset >= size)
+        return 0;
+    if (nbytes > size - offset)
+        nbytes = size - offset;
+    if (!nbytes)
+        return 0;
+
+    memset(&aiocb, 0, sizeof(aiocb));
+    aiocb.aio_dev = dev;
+    aiocb.aio_buf = buf;
+    aiocb.aio_nbytes = nbytes;
+    aiocb.aio_offset = offset;
+    ret = blkfront_do_io(&aiocb, write);
+    if (ret)
+        return ret;
+    return nbytes;
+}
+
+ssize_t blkfront_pread(struct blkfront_dev *dev, void *buf, size_t nbytes, off_t offset)
+{
+    return blkfront_prw(dev, buf, nbytes, offset, 0);
+}
+
+ssize_t blkfront_pwrite(struct blkfront_dev *dev, const void *buf, size_t nbytes, off_t offset)
+{
+    return blkfront_prw(dev, (void*) buf, nbytes, offset, 1);
+}
+
+void blkfront_get_info(struct blkfront_dev *dev, struct blkfront_info *info)
+{
+    *info = dev->info;
+}
+
+void blkfront_get_iostat(struct blkfront_dev *dev, struct blkfront_iostat *stat)
+{
+    *stat = dev->iostat;
+}
+
+void blkfront_reset_iostat(struct blkfront_dev *dev)
+{
+    memset(&dev->iostat, 0, sizeof(dev->iostat));
+}
+
+static const char *const blkfront_stat_names[BLKFRONT_STAT_OPS] = {
+    [BLKFRONT_STAT_READ] = "read",
+    [BLKFRONT_STAT_WRITE] = "write",
+    [BLKFRONT_STAT_FLUSH] = "flush",
+    [BLKFRONT_STAT_DISCARD] = "discard",
+};
+
+/* Print the statistics on the console, and summaries in the frontend's
+ * xenstore directory under iostat/.  */
+void blkfront_dump_iostat(struct blkfront_dev *dev)
+{
+    struct blkfront_iostat *stat = &dev->iostat;
+    char path[strlen(dev->nodename) + 1 + 7 + 1];
+    char *err;
+    int op, b;
+
+    snprintf(path, sizeof(path), "%s/iostat", dev->nodename);
+    for (op = 0; op < BLKFRONT_STAT_OPS; op++) {
+        struct blkfront_op_stats *opstat = &stat->op[op];
+        unsigned long long avg = opstat->completed ?
+            opstat->lat_total / opstat->completed / 1000 : 0;
+
+        if (!opstat->ops)
+            continue;
+        printk("%s %s: %llu ops %llu bytes %llu errors, latency avg %lluus max %lluus\n",
+                dev->nodename, blkfront_stat_names[op],
+                (unsigned long long) opstat->ops, (unsigned long long) opstat->bytes,
+                (unsigned long long) opstat->errors, avg,
+                (unsigned long long) opstat->lat_max / 1000);
+        for (b = 0; b < BLKFRONT_LAT_BUCKETS; b++)
+            if (opstat->lat_hist[b])
+                printk("  %s%8lluus: %llu\n", b == BLKFRONT_LAT_BUCKETS - 1 ? ">=" : "< ",
+                        1ULL << (b == BLKFRONT_LAT_BUCKETS - 1 ? b : b + 1),
+                        (unsigned long long) opstat->lat_hist[b]);
+
+        err = xenbus_printf(XBT_NIL, path, blkfront_stat_names[op], "%llu %llu %llu %llu %llu",
+                (unsigned long long) opstat->ops, (unsigned long long) opstat->bytes,
+                (unsigned long long) opstat->errors, avg,
+                (unsigned long long) opstat->lat_max / 1000);
+        if (err)
+            free(err);
+    }
+
+    if (!stat->depth_samples)
+        return;
+    printk("%s queue depth: avg %llu max %u\n", dev->nodename,
+            (unsigned long long) (stat->depth_total / stat->depth_samples), stat->depth_max);
+    for (b = 0; b < BLKFRONT_DEPTH_BUCKETS; b++)
+        if (stat->depth_hist[b])
+            printk("  %s%4llu: %llu\n", b == BLKFRONT_DEPTH_BUCKETS - 1 ? ">=" : "< ",
+                    1ULL << (b == BLKFRONT_DEPTH_BUCKETS - 1 ? b : b + 1),
+                    (unsigned long long) stat->depth_hist[b]);
+    err = xenbus_printf(XBT_NIL, path, "depth", "%llu %u",
+            (unsigned long long) (stat->depth_total / stat->depth_samples), stat->depth_max);
+    if (err)
+        free(err);
+}
+
+static void blkfront_iostat_thread(void *p)
+{
+    struct blkfront_dev *dev = p;
+
+    while (dev->iostat_interval) {
+        wait_event_deadline(dev->iostat_queue, !dev->iostat_interval,
+                NOW() + dev->iostat_interval);
+        if (dev->iostat_interval)
+            blkfront_dump_iostat(dev);
+    }
+    dev->iostat_thread = NULL;
+    wake_up(&dev->iostat_queue);
+}
+
+/* Dump the statistics every interval, 0 stops.  */
+void blkfront_set_iostat_interval(struct blkfront_dev *dev, s_time_t interval)
+{
+    dev->iostat_interval = interval;
+    if (interval && !dev->iostat_thread)
+        dev->iostat_thread = create_thread_ex("blkfront iostat", blkfront_iostat_thread,
+                                             dev, 4 * PAGE_SIZE);
+    else if (!interval && dev->iostat_thread) {
+        wake_up(&dev->iostat_queue);
+        wait_event(dev->iostat_queue, !dev->iostat_thread);
+    }
+}
+
+#ifndef __ia64__
+/* Demand-paged mappings.  The range is reserved in the demand mapping area
+ * with PTEs left not present; pages are read from the device in clusters on
+ * first touch and mapped read-only until written to.  Dirty pages are written
+ * back on msync, munmap, and when evicted to keep at most
+ * BLKFRONT_MAP_RESIDENT pages resident.  Mappings are not kept coherent with
+ * read/write on the device.  */
+
+#define BLKFRONT_MAP_CLUSTER 8
+#define BLKFRONT_MAP_RESIDENT 4096
+/* Pinned pages cannot be evicted, leave the rest for faults */
+#define BLKFRONT_MAP_PINNED (BLKFRONT_MAP_RESIDENT / 2)
+
+/* Page entries are the page address or'ed with the state, 0 when the page is
+ * not resident.  */
+#define BLKMAP_CLEAN 1
+#define BLKMAP_DIRTY 2
+/* Being read in or written back */
+#define BLKMAP_BUSY 3
+#define BLKMAP_STATE(entry) ((entry) & ~PAGE_MASK)
+#define BLKMAP_PAGE(entry) ((entry) & PAGE_MASK)
+
+struct blkfront_map {
+    MINIOS_TAILQ_ENTRY(struct blkfront_map) list;
+    struct blkfront_dev *dev;
+    unsigned long va;
+    unsigned long n;
+    uint64_t offset;
+    int writable;
+    unsigned long *pages;
+    /* Pages kept resident, e.g. while granted to the backend */
+    unsigned *pins;
+};
+
+static MINIOS_TAILQ_HEAD(, struct blkfront_map) blkfront_maps =
+    MINIOS_TAILQ_HEAD_INITIALIZER(blkfront_maps);
+/* Woken when a page stops being busy */
+static DECLARE_WAIT_QUEUE_HEAD(blkfront_map_queue);
+
+/* Resident pages, oldest first */
+static struct {
+    struct blkfront_map *map;
+    unsigned long idx;
+} blkfront_map_fifo[BLKFRONT_MAP_RESIDENT];
+static unsigned blkfront_map_head, blkfront_map_nr;
+/* Including pages being read in */
+static unsigned blkfront_map_resident;
+/* Resident pages with a pin */
+static unsigned blkfront_map_pinned;
+
+static struct blkfront_map *blkfront_map_find(unsigned long addr)
+{
+    struct blkfront_map *map;
+
+    MINIOS_TAILQ_FOREACH(map, &blkfront_maps, list)
+        if (addr >= map->va && addr - map->va < map->n * PAGE_SIZE)
+            return map;
+    return NULL;
+}
+
+static void blkfront_map_wait(void)
+{
+    DEFINE_WAIT(w);
+
+    add_waiter(w, blkfront_map_queue);
+    schedule();
+    remove_waiter(w, blkfront_map_queue);
+}
+
+static void blkfront_map_pte(struct blkfront_map *map, unsigned long idx, unsigned long prot)
+{
+    unsigned long mfn = virt_to_mfn(BLKMAP_PAGE(map->pages[idx]));
+
+    do_map_frames(map->va + idx * PAGE_SIZE, &mfn, 1, 0, 0, DOMID_SELF, NULL, prot);
+}
+
+static void blkfront_map_push(struct blkfront_map *map, unsigned long idx)
+{
+    unsigned tail = (blkfront_map_head + blkfront_map_nr) % BLKFRONT_MAP_RESIDENT;
+
+    ASSERT(blkfront_map_nr < BLKFRONT_MAP_RESIDENT);
+    blkfront_map_fifo[tail].map = map;
+    blkfront_map_fifo[tail].idx = idx;
+    blkfront_map_nr++;
+}
+
+/* Write a dirty page back, with the page marked busy */
+static int blkfront_map_writeback(struct blkfront_map *map, unsigned long idx)
+{
+    unsigned long page = BLKMAP_PAGE(map->pages[idx]);
+    ssize_t ret;
+
+    map->pages[idx] = page | BLKMAP_BUSY;
+    ret = blkfront_pwrite(map->dev, (void*) page, PAGE_SIZE, map->offset + idx * PAGE_SIZE);
+    if (ret < 0) {
+        printk("blkfront: writing back %lx of %s failed: %d\n",
+                map->va + idx * PAGE_SIZE, map->dev->nodename, (int) ret);
+        map->pages[idx] = page | BLKMAP_DIRTY;
+    } else
+        map->pages[idx] = page | BLKMAP_CLEAN;
+    wake_up(&blkfront_map_queue);
+    return ret < 0 ? ret : 0;
+}
+
+/* Evict the oldest resident page, returns 0 if there is none.  */
+static int blkfront_map_evict(void)
+{
+    unsigned tries;
+
+    for (tries = blkfront_map_nr; tries; tries--) {
+        struct blkfront_map *map = blkfront_map_fifo[blkfront_map_head].map;
+        unsigned long idx = blkfront_map_fifo[blkfront_map_head].idx;
+        unsigned long page = BLKMAP_PAGE(map->pages[idx]);
+
+        blkfront_map_head = (blkfront_map_head + 1) % BLKFRONT_MAP_RESIDENT;
+        blkfront_map_nr--;
+        if (BLKMAP_STATE(map->pages[idx]) == BLKMAP_BUSY || map->pins[idx]) {
+            /* Being synced or pinned, try it again later */
+            blkfront_map_push(map, idx);
+            continue;
+        }
+
+        /* Stop further accesses before writing it back */
+        reserve_frames(map->va + idx * PAGE_SIZE, 1);
+        if (BLKMAP_STATE(map->pages[idx]) == BLKMAP_DIRTY)
+            blkfront_map_writeback(map, idx);
+        map->pages[idx] = 0;
+        free_page((void*) page);
+        blkfront_map_resident--;
+        wake_up(&blkfront_map_queue);
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned long blkfront_map_alloc(void)
+{
+    unsigned long page;
+
+    while (1) {
+        if (blkfront_map_resident < BLKFRONT_MAP_RESIDENT && (page = alloc_page())) {
+            blkfront_map_resident++;
+            return page;
+        }
+        if (!blkfront_map_evict())
+            return 0;
+    }
+}
+
+/* Read in the cluster of pages starting at idx */
+static int blkfront_map_read(struct blkfront_map *map, unsigned long idx, int write)
+{
+    struct blkfront_dev *dev = map->dev;
+    struct blkfront_iov iov[BLKFRONT_MAP_CLUSTER];
+    struct blkfront_aiocb aiocb;
+    uint64_t size = dev->info.sectors * dev->info.sector_size;
+    uint64_t offset = map->offset + idx * PAGE_SIZE;
+    unsigned long n, i;
+    int ret = 0;
+
+    /* Claim the cluster before anything may block.  */
+    for (n = 0; n < BLKFRONT_MAP_CLUSTER && idx + n < map->n && !map->pages[idx + n]; n++)
+        map->pages[idx + n] = BLKMAP_BUSY;
+
+    for (i = 0; i < n; i++) {
+        unsigned long page = blkfront_map_alloc();
+
+        if (!page)
+            break;
+        map->pages[idx + i] = page | BLKMAP_BUSY;
+        iov[i].iov_base = (void*) page;
+        iov[i].iov_len = PAGE_SIZE;
+        /* Beyond the end of the device reads as zeroes */
+        if (offset + (i + 1) * PAGE_SIZE > size) {
+            memset((void*) page, 0, PAGE_SIZE);
+            if (offset + i * PAGE_SIZE >= size)
+                iov[i].iov_len = 0;
+            else
+                iov[i].iov_len = size - offset - i * PAGE_SIZE;
+        }
+    }
+    for (; n > i; n--)
+        map->pages[idx + n - 1] = 0;
+
+    if (!n)
+        ret = -ENOMEM;
+    else if (iov[0].iov_len) {
+        memset(&aiocb, 0, sizeof(aiocb));
+        aiocb.aio_dev = dev;
+        aiocb.aio_iov = iov;
+        for (i = 0; i < n && iov[i].iov_len; i++)
+            ;
+        aiocb.aio_iovcnt = i;
+        aiocb.aio_offset = offset;
+        ret = blkfront_do_io(&aiocb, 0);
+    }
+
+    for (i = 0; i < n; i++) {
+        unsigned long page = BLKMAP_PAGE(map->pages[idx + i]);
+
+        if (ret) {
+            free_page((void*) page);
+            blkfront_map_resident--;
+            map->pages[idx + i] = 0;
+        } else if (write && !i) {
+            map->pages[idx + i] = page | BLKMAP_DIRTY;
+            blkfront_map_pte(map, idx + i, L1_PROT);
+            blkfront_map_push(map, idx + i);
+        } else {
+            map->pages[idx + i] = page | BLKMAP_CLEAN;
+            blkfront_map_pte(map, idx + i, L1_PROT_RO);
+            blkfront_map_push(map, idx + i);
+        }
+    }
+    wake_up(&blkfront_map_queue);
+
+    if (ret)
+        printk("blkfront: reading in %lx of %s failed: %d\n",
+                map->va + idx * PAGE_SIZE, dev->nodename, ret);
+    return ret;
+}
+
+/* Called on page faults, returns 1 when the fault was resolved.  */
+int blkfront_map_fault(unsigned long addr, int write)
+{
+    struct blkfront_map *map;
+    unsigned long idx, entry;
+
+    while (1) {
+        map = blkfront_map_find(addr);
+        if (!map || (write && !map->writable))
+            return 0;
+        idx = (addr - map->va) >> PAGE_SHIFT;
+        entry = map->pages[idx];
+
+        switch (BLKMAP_STATE(entry)) {
+        case 0:
+            return !blkfront_map_read(map, idx, write);
+        case BLKMAP_BUSY:
+            blkfront_map_wait();
+            break;
+        case BLKMAP_CLEAN:
+            if (write) {
+                map->pages[idx] = BLKMAP_PAGE(entry) | BLKMAP_DIRTY;
+                blkfront_map_pte(map, idx, L1_PROT);
+            }
+            return 1;
+        default:
+            /* Already resolved by another thread */
+            return 1;
+        }
+    }
+}
+
+void *blkfront_mmap(struct blkfront_dev *dev, size_t length, off_t offset, int writable)
+{
+    struct blkfront_map *map;
+    unsigned long n = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    if (!n || offset < 0 || (offset & (PAGE_SIZE - 1)))
+        return ERR_PTR(-EINVAL);
+    if (writable && dev->info.mode != O_RDWR)
+        return ERR_PTR(-EACCES);
+
+    map = xmalloc(struct blkfront_map);
+    if (!map)
+        return ERR_PTR(-ENOMEM);
+    map->pages = xmalloc_array(unsigned long, n);
+    if (!map->pages) {
+        xfree(map);
+        return ERR_PTR(-ENOMEM);
+    }
+    memset(map->pages, 0, n * sizeof(*map->pages));
+    map->pins = xmalloc_array(unsigned, n);
+    if (!map->pins) {
+        xfree(map->pages);
+        xfree(map);
+        return ERR_PTR(-ENOMEM);
+    }
+    memset(map->pins, 0, n * sizeof(*map->pins));
+    map->dev = dev;
+    map->n = n;
+    map->offset = offset;
+    map->writable = writable;
+
+    map->va = allocate_ondemand(n, 1);
+    if (!map->va || reserve_frames(map->va, n)) {
+        xfree(map->pins);
+        xfree(map->pages);
+        xfree(map);
+        return ERR_PTR(-ENOMEM);
+    }
+    MINIOS_TAILQ_INSERT_TAIL(&blkfront_maps, map, list);
+    return (void*) map->va;
+}
+
+/* Write back the dirty pages in [first, last), returns the first error */
+static int blkfront_map_sync(struct blkfront_map *map, unsigned long first, unsigned long last)
+{
+    unsigned long idx;
+    int ret = 0, err;
+
+    for (idx = first; idx < last; idx++) {
+        while (BLKMAP_STATE(map->pages[idx]) == BLKMAP_BUSY)
+            blkfront_map_wait();
+        if (BLKMAP_STATE(map->pages[idx]) != BLKMAP_DIRTY)
+            continue;
+        /* Catch writes made from now on */
+        blkfront_map_pte(map, idx, L1_PROT_RO);
+        err = blkfront_map_writeback(map, idx);
+        if (err) {
+            blkfront_map_pte(map, idx, L1_PROT);
+            if (!ret)
+                ret = err;
+        }
+    }
+    return ret;
+}
+
+int blkfront_msync(void *addr, size_t length, int sync)
+{
+    unsigned long start = (unsigned long) addr;
+    struct blkfront_map *map = blkfront_map_find(start);
+    unsigned long first, last;
+    int ret;
+
+    if (!map)
+        return -ENOENT;
+    first = (start - map->va) >> PAGE_SHIFT;
+    last = (start - map->va + length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (last > map->n)
+        return -ENOMEM;
+
+    ret = blkfront_map_sync(map, first, last);
+    if (!ret && sync)
+        ret = blkfront_sync(map->dev);
+    return ret;
+}
+
+int blkfront_munmap(void *addr, size_t length)
+{
+    struct blkfront_map *map = blkfront_map_find((unsigned long) addr);
+    unsigned long idx, n = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    unsigned i, j;
+    int ret;
+
+    if (!map)
+        return -ENOENT;
+    /* Only whole mappings can be unmapped */
+    if ((unsigned long) addr != map->va || n != map->n)
+        return -EINVAL;
+
+    /* Pinned pages are still in use, by the backend or with events
+     * disabled */
+    for (idx = 0; idx < map->n; idx++)
+        while (map->pins[idx])
+            blkfront_map_wait();
+
+    /* Further accesses are fatal */
+    MINIOS_TAILQ_REMOVE(&blkfront_maps, map, list);
+    ret = blkfront_map_sync(map, 0, map->n);
+    /* Wait for evictions still writing pages back */
+    for (idx = 0; idx < map->n; idx++)
+        while (BLKMAP_STATE(map->pages[idx]) == BLKMAP_BUSY)
+            blkfront_map_wait();
+    unmap_frames(map->va, map->n);
+
+    for (i = j = 0; i < blkfront_map_nr; i++) {
+        unsigned from = (blkfront_map_head + i) % BLKFRONT_MAP_RESIDENT;
+
+        if (blkfront_map_fifo[from].map != map)
+            blkfront_map_fifo[(blkfront_map_head + j++) % BLKFRONT_MAP_RESIDENT] =
+                blkfront_map_fifo[from];
+    }
+    blkfront_map_nr = j;
+    for (idx = 0; idx < map->n; idx++)
+        if (map->pages[idx]) {
+            free_page((void*) BLKMAP_PAGE(map->pages[idx]));
+            blkfront_map_resident--;
+        }
+
+    xfree(map->pins);
+    xfree(map->pages);
+    xfree(map);
+    return ret;
+}
+
+/*
+ * Fault in the mapped pages of [buf, buf + len), writable if write, and keep
+ * them resident until blkfront_map_unpin.  Needed before granting them, or
+ * before accessing them with events disabled, when faults cannot be served.
+ * Returns the number of mapped pages pinned, -EFAULT if one cannot be
+ * faulted in, or -ENOMEM if more than BLKFRONT_MAP_PINNED pages would be
+ * pinned.
+ */
+int blkfront_map_pin(const void *buf, size_t len, int write)
+{
+    unsigned long start = (unsigned long) buf & PAGE_MASK;
+    unsigned long end = (unsigned long) buf + len;
+    unsigned long addr, idx, flags;
+    struct blkfront_map *map;
+    int n = 0;
+
+    if (MINIOS_TAILQ_EMPTY(&blkfront_maps))
+        return 0;
+
+    for (addr = start; addr < end; addr += PAGE_SIZE) {
+        while (1) {
+            local_irq_save(flags);
+            map = blkfront_map_find(addr);
+            if (!map)
+                break;
+            idx = (addr - map->va) >> PAGE_SHIFT;
+            if (BLKMAP_STATE(map->pages[idx]) == BLKMAP_DIRTY ||
+                    (BLKMAP_STATE(map->pages[idx]) == BLKMAP_CLEAN && !write)) {
+                if (!map->pins[idx] && blkfront_map_pinned >= BLKFRONT_MAP_PINNED) {
+                    local_irq_restore(flags);
+                    blkfront_map_unpin((void*) start, addr - start);
+                    return -ENOMEM;
+                }
+                if (!map->pins[idx]++)
+                    blkfront_map_pinned++;
+                n++;
+                break;
+            }
+            local_irq_restore(flags);
+            if (!blkfront_map_fault(addr, write)) {
+                blkfront_map_unpin((void*) start, addr - start);
+                return -EFAULT;
+            }
+        }
+        local_irq_restore(flags);
+    }
+    return n;
+}
+
+void blkfront_map_unpin(const void *buf, size_t len)
+{
+    unsigned long start = (unsigned long) buf & PAGE_MASK;
+    unsigned long end = (unsigned long) buf + len;
+    unsigned long addr, idx, flags;
+    struct blkfront_map *map;
+
+    for (addr = start; addr < end; addr += PAGE_SIZE) {
+        local_irq_save(flags);
+        map = blkfront_map_find(addr);
+        if (map) {
+            idx = (addr - map->va) >> PAGE_SHIFT;
+            if (!--map->pins[idx]) {
+                blkfront_map_pinned--;
+                wake_up(&blkfront_map_queue);
+            }
+        }
+        local_irq_restore(flags);
+    }
+}
+#endif
+
+static void blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, struct blkfront_aiocb *aiocbp)
+{
+    int i;
+    struct blkif_request *req;
+    unsigned long flags;
+
+    blkfront_wait_slot(dev, &flags);
+    i = dev->ring.req_prod_pvt;
+    req = RING_GET_REQUEST(&dev->ring, i);
+    req->operation = op;
+    req->nr_segments = 0;
+    req->handle = dev->handle;
+    req->id = (uintptr_t) aiocbp;
+    /* Not needed anyway, but the backend will check it */
+    req->sector_number = 0;
+    dev->ring.req_prod_pvt = i + 1;
+    blkfront_stat_submit(dev, aiocbp, op, 0);
+    local_irq_restore(flags);
+    blkfront_push(dev);
+}
+
+void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    aiocbp->waiter = NULL;
+    blkfront_push_operation(dev, op, aiocbp);
+}
+
+/* Returns the first error writing the cache back or of the barrier/flush */
+int blkfront_sync(struct blkfront_dev *dev)
+{
+    /* Their completion is waited for by draining the ring below */
+    struct blkfront_aiocb barrier, flush;
+    struct blkfront_pending io = { 0, 0 };
+    unsigned long flags;
+    int ret = 0;
+    DEFINE_WAIT(w);
+
+    /* Dirty blocks have to reach the backend before the barrier/flush.  */
+    if (dev->cache)
+        ret = blkfront_cache_flush(dev);
+
+    if (dev->info.mode == O_RDWR) {
+        if (dev->info.barrier == 1) {
+            memset(&barrier, 0, sizeof(barrier));
+            barrier.aio_dev = dev;
+            barrier.aio_cb = blkfront_pending_cb;
+            barrier.data = &io;
+            io.pending++;
+            blkfront_push_operation(dev, BLKIF_OP_WRITE_BARRIER, &barrier);
+        }
+
+        if (dev->info.flush == 1) {
+            memset(&flush, 0, sizeof(flush));
+            flush.aio_dev = dev;
+            flush.aio_cb = blkfront_pending_cb;
+            flush.data = &io;
+            io.pending++;
+            blkfront_push_operation(dev, BLKIF_OP_FLUSH_DISKCACHE, &flush);
+        }
+    }
+
+    /* Note: This won't finish if another thread enqueues requests.  */
+    local_irq_save(flags);
+    while (1) {
+	blkfront_aio_poll(dev);
+	if (RING_FREE_REQUESTS(&dev->ring) == RING_SIZE(&dev->ring))
+	    break;
+
+	add_waiter(w, dev->io_queue);
+	local_irq_restore(flags);
+	schedule();
+	local_irq_save(flags);
+    }
+    remove_waiter(w, dev->io_queue);
+    local_irq_restore(flags);
+
+    return ret ? ret : io.error;
+}
+
+int blkfront_aio_poll(struct blkfront_dev *dev)
+{
+    RING_IDX rp, cons;
+    struct blkif_response rsp;
+    unsigned long flags;
+    int more;
+    int nr_consumed = 0;
+
+moretodo:
+#ifdef HAVE_LIBC
+    if (dev->fd != -1) {
+        files[dev->fd].read = 0;
+        mb(); /* Make sure to let the handler set read to 1 before we start looking at the ring */
+    }
+#endif
+
+    /* Each response is taken off the ring with events disabled, so that
+     * pollers preempting each other, or reentering from callbacks, never
+     * see the same one.  It is handled with them restored.  */
+    local_irq_save(flags);
+    while (1)
+    {
+        struct blkfront_aiocb *aiocbp;
+        int status;
+
+        rp = dev->ring.sring->rsp_prod;
+        rmb(); /* Ensure we see queued responses up to 'rp'. */
+        cons = dev->ring.rsp_cons;
+        if (cons == rp)
+            break;
+
+        rsp = *RING_GET_RESPONSE(&dev->ring, cons);
+        dev->ring.rsp_cons = cons + 1;
+        local_irq_restore(flags);
+        nr_consumed++;
+
+        /* Every request carries an aiocb */
+        aiocbp = (void*) (uintptr_t) rsp.id;
+        ASSERT(aiocbp);
+        status = rsp.status;
+
+        if (status != BLKIF_RSP_OKAY)
+            printk("block error %d for op %d\n", status, rsp.operation);
+        blkfront_stat_complete(dev, aiocbp, rsp.operation, status);
+
+        switch (rsp.operation) {
+        case BLKIF_OP_READ:
+        case BLKIF_OP_WRITE:
+        {
+            int j;
+
+            for (j = 0; j < aiocbp->n; j++)
+                gnttab_end_access(aiocbp->gref[j]);
+            blkfront_unpin_aio(aiocbp);
+
+            break;
+        }
+
+        case BLKIF_OP_WRITE_BARRIER:
+        case BLKIF_OP_FLUSH_DISKCACHE:
+            break;
+
+        case BLKIF_OP_DISCARD:
+            if (status == BLKIF_RSP_EOPNOTSUPP) {
+                printk("backend does not support discard after all\n");
+                dev->info.discard = 0;
+            }
+            break;
+
+        default:
+            printk("unrecognized block operation %d response\n", rsp.operation);
+        }
+
+        /* Nota: callback frees aiocbp itself */
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, status ? -EIO : 0);
+        local_irq_save(flags);
+    }
+
+    RING_FINAL_CHECK_FOR_RESPONSES(&dev->ring, more);
+    if (nr_consumed) {
+        /* Slots got freed, and the ring may have drained for blkfront_sync */
+        wake_up(&dev->slot_queue);
+        if (dev->ring.rsp_cons == dev->ring.req_prod_pvt)
+            wake_up(&dev->io_queue);
+    }
+    local_irq_restore(flags);
+    if (more) goto moretodo;
+
+    return nr_consumed;
+}
+
+/*
+ * Completion rings.
+ *
+ * Applications queue requests in a submission queue, and reap their results
+ * from a completion queue instead of getting callbacks.  Everything is
+ * allocated when the ring is set up: the number of requests that are queued,
+ * in flight or waiting to be reaped is bounded by the number of entries.
+ */
+struct blkfront_ioring_req {
+    struct blkfront_aiocb aiocb;
+    struct blkfront_ioring *ring;
+    uint64_t user_data;
+};
+
+struct blkfront_ioring {
+    struct blkfront_dev *dev;
+    unsigned entries;
+    struct blkfront_sqe *sq;
+    unsigned sq_head, sq_tail;
+    struct blkfront_cqe *cq;
+    unsigned cq_head, cq_tail;
+    struct blkfront_ioring_req *reqs;
+    struct blkfront_ioring_req **free_reqs;
+    unsigned nr_free;
+};
+
+static void blkfront_ioring_cb(struct blkfront_aiocb *aiocbp, int ret)
+{
+    struct blkfront_ioring_req *req = aiocbp->data;
+    struct blkfront_ioring *ring = req->ring;
+    struct blkfront_cqe *cqe = &ring->cq[ring->cq_tail++ & (ring->entries - 1)];
+
+    cqe->user_data = req->user_data;
+    cqe->res = ret;
+    ring->free_reqs[ring->nr_free++] = req;
+    wake_up(&ring->dev->io_queue);
+}
+
+struct blkfront_ioring *blkfront_ioring_init(struct blkfront_dev *dev, unsigned entries)
+{
+    struct blkfront_ioring *ring;
+    unsigned size, i;
+
+    for (size = 1; size < entries; size <<= 1)
+        ;
+
+    ring = xmalloc(struct blkfront_ioring);
+    if (!ring)
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    ring->dev = dev;
+    ring->entries = size;
+    ring->sq = xmalloc_array(struct blkfront_sqe, size);
+    ring->cq = xmalloc_array(struct blkfront_cqe, size);
+    ring->reqs = xmalloc_array(struct blkfront_ioring_req, size);
+    ring->free_reqs = xmalloc_array(struct blkfront_ioring_req *, size);
+    if (!ring->sq || !ring->cq || !ring->reqs || !ring->free_reqs) {
+        free(ring->sq);
+        free(ring->cq);
+        free(ring->reqs);
+        free(ring->free_reqs);
+        free(ring);
+        return NULL;
+    }
+
+    for (i = 0; i < size; i++) {
+        ring->reqs[i].ring = ring;
+        ring->free_reqs[i] = &ring->reqs[i];
+    }
+    ring->nr_free = size;
+    return ring;
+}
+
+/* Wait for requests in flight and free the ring */
+void blkfront_ioring_fini(struct blkfront_ioring *ring)
+{
+    struct blkfront_dev *dev = ring->dev;
+    unsigned long flags;
+    DEFINE_WAIT(w);
+
+    blkfront_push(dev);
+    local_irq_save(flags);
+    while (1) {
+	blkfront_aio_poll(dev);
+	if (ring->nr_free + (ring->sq_tail - ring->sq_head) == ring->entries)
+	    break;
+
+	add_waiter(w, dev->io_queue);
+	local_irq_restore(flags);
+	schedule();
+	local_irq_save(flags);
+    }
+    remove_waiter(w, dev->io_queue);
+    local_irq_restore(flags);
+
+    free(ring->sq);
+    free(ring->cq);
+    free(ring->reqs);
+    free(ring->free_reqs);
+    free(ring);
+}
+
+/* Get a free submission queue entry, or NULL if the ring is full */
+struct blkfront_sqe *blkfront_ioring_get_sqe(struct blkfront_ioring *ring)
+{
+    unsigned used = (ring->sq_tail - ring->sq_head) + (ring->entries - ring->nr_free)
+        + (ring->cq_tail - ring->cq_head);
+    struct blkfront_sqe *sqe;
+
+    if (used >= ring->entries)
+        return NULL;
+    sqe = &ring->sq[ring->sq_tail++ & (ring->entries - 1)];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Whether the sqe can go to the backend in one request, straight from its
+ * buffers.  Otherwise it would need bounce buffers allocated on the way.  */
+static int blkfront_ioring_direct(struct blkfront_dev *dev, struct blkfront_sqe *sqe)
+{
+    struct blkfront_iov iov, *iovp = &iov;
+    int iovcnt = 1;
+
+    if (sqe->offset < 0 || (sqe->offset & (dev->info.sector_size - 1)))
+        return 0;
+    if (sqe->buf) {
+        iov.iov_base = sqe->buf;
+        iov.iov_len = sqe->nbytes;
+    } else {
+        iovp = sqe->iov;
+        iovcnt = sqe->iovcnt;
+    }
+    return blkfront_iov_segments(dev, iovp, iovcnt) > 0;
+}
+
+/* Issue the queued entries, returns how many there were */
+int blkfront_ioring_submit(struct blkfront_ioring *ring)
+{
+    struct blkfront_dev *dev = ring->dev;
+    int n = 0;
+
+    while (ring->sq_head != ring->sq_tail) {
+        struct blkfront_sqe *sqe = &ring->sq[ring->sq_head++ & (ring->entries - 1)];
+        struct blkfront_ioring_req *req = ring->free_reqs[--ring->nr_free];
+        struct blkfront_aiocb *aiocbp = &req->aiocb;
+        int write;
+
+        memset(aiocbp, 0, sizeof(*aiocbp));
+        aiocbp->aio_dev = dev;
+        aiocbp->aio_buf = sqe->buf;
+        aiocbp->aio_nbytes = sqe->nbytes;
+        aiocbp->aio_offset = sqe->offset;
+        aiocbp->aio_iov = sqe->iov;
+        aiocbp->aio_iovcnt = sqe->iovcnt;
+        aiocbp->data = req;
+        aiocbp->aio_cb = blkfront_ioring_cb;
+        req->user_data = sqe->user_data;
+        n++;
+
+        switch (sqe->op) {
+        case BLKIF_OP_READ:
+        case BLKIF_OP_WRITE:
+            write = sqe->op == BLKIF_OP_WRITE;
+            if (!blkfront_ioring_direct(dev, sqe))
+                blkfront_ioring_cb(aiocbp, -EINVAL);
+            else if (!blkfront_aio_prepare(aiocbp, write))
+                blkfront_queue_aio(aiocbp, write);
+            break;
+
+        case BLKIF_OP_WRITE_BARRIER:
+        case BLKIF_OP_FLUSH_DISKCACHE:
+            blkfront_aio_push_operation(aiocbp, sqe->op);
+            break;
+
+        case BLKIF_OP_DISCARD:
+            if (!dev->info.discard)
+                blkfront_ioring_cb(aiocbp, -EOPNOTSUPP);
+            else if (sqe->offset < 0 ||
+                    (((uint64_t) sqe->offset | sqe->nbytes) & (dev->info.sector_size - 1)))
+                blkfront_ioring_cb(aiocbp, -EINVAL);
+            else
+                blkfront_aio_discard(aiocbp, 0);
+            break;
+
+        default:
+            blkfront_ioring_cb(aiocbp, -EINVAL);
+        }
+    }
+
+    blkfront_push(dev);
+    return n;
+}
+
+/* Get the oldest completion not seen yet, or NULL if there is none */
+struct blkfront_cqe *blkfront_ioring_peek_cqe(struct blkfront_ioring *ring)
+{
+    if (ring->cq_head == ring->cq_tail)
+        blkfront_aio_poll(ring->dev);
+    if (ring->cq_head == ring->cq_tail)
+        return NULL;
+    return &ring->cq[ring->cq_head & (ring->entries - 1)];
+}
+
+void blkfront_ioring_cqe_seen(struct blkfront_ioring *ring)
+{
+    ring->cq_head++;
+}
+
+/* Wait until nr completions are available, or until the deadline if it is
+ * not 0.  Returns how many are available.  */
+unsigned blkfront_ioring_wait_cqes(struct blkfront_ioring *ring, unsigned nr, s_time_t deadline)
+{
+    struct blkfront_dev *dev = ring->dev;
+    unsigned long flags;
+    unsigned max;
+    DEFINE_WAIT(w);
+
+    /* Don't wait for more than can come */
+    max = (ring->cq_tail - ring->cq_head) + (ring->entries - ring->nr_free);
+    if (nr > max)
+        nr = max;
+
+    blkfront_push(dev);
+    local_irq_save(flags);
+    while (1) {
+	blkfront_aio_poll(dev);
+	if (ring->cq_tail - ring->cq_head >= nr || (deadline && NOW() >= deadline))
+	    break;
+
+	add_waiter(w, dev->io_queue);
+	current->wakeup_time = deadline;
+	local_irq_restore(flags);
+	schedule();
+	local_irq_save(flags);
+    }
+    remove_waiter(w, dev->io_queue);
+    local_irq_restore(flags);
+
+    return ring->cq_tail - ring->cq_head;
 }
 
 #ifdef HAVE_LIBC
@@ -550,6 +3254,7 @@ int blkfront_open(struct blkfront_dev *dev)
     dev->fd = alloc_fd(FTYPE_BLK);
     printk("blk_open(%s) -> %d\n", dev->nodename, dev->fd);
     files[dev->fd].blk.dev = dev;
+    files[dev->fd].blk.offset = 0;
     return dev->fd;
 }
 #endif
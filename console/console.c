@@ -42,6 +42,7 @@
 #include <mini-os/os.h>
 #include <mini-os/lib.h>
 #include <mini-os/xenbus.h>
+#include <mini-os/sched.h>
 #include <xen/io/console.h>
 
 
@@ -58,6 +59,12 @@ static int console_initialised = 0;
 #ifndef HAVE_LIBC
 void xencons_rx(char *buf, unsigned len, struct pt_regs *regs)
 {
+    /* ^T prints what the threads are doing, like SIGINFO on BSD */
+    if(len == 1 && buf[0] == 0x14)
+    {
+        print_thread_stats();
+        return;
+    }
     if(len > 0)
     {
         /* Just repeat what's written */
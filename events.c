@@ -173,6 +173,13 @@ static struct pda
     int irqcount;       /* offset 0 (used in x86_64.S) */
     char *irqstackptr;  /*        8 */
 } cpu0_pda;
+
+/* get_current() reads the thread pointer at the base of the stack, so that
+ * it finds the interrupted thread on the IRQ stack too */
+void irqstack_set_current(void *thread)
+{
+    *(void **)(cpu0_pda.irqstackptr - STACK_SIZE) = thread;
+}
 #endif
 
 /*
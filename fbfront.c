@@ -201,6 +201,7 @@ int kbdfront_receive(struct kbdfront_dev *dev, union xenkbd_in_event *buf, int n
 {
     struct xenkbd_page *page = dev->page;
     uint32_t prod, cons;
+    unsigned long flags;
     int i;
 
 #ifdef HAVE_LIBC
@@ -210,10 +211,14 @@ int kbdfront_receive(struct kbdfront_dev *dev, union xenkbd_in_event *buf, int n
     }
 #endif
 
+    /* Readers preempting each other must not get the same events */
+    local_irq_save(flags);
     prod = page->in_prod;
 
-    if (prod == page->in_cons)
+    if (prod == page->in_cons) {
+        local_irq_restore(flags);
         return 0;
+    }
 
     rmb();      /* ensure we see ring contents up to prod */
 
@@ -222,6 +227,7 @@ int kbdfront_receive(struct kbdfront_dev *dev, union xenkbd_in_event *buf, int n
 
     mb();       /* ensure we got ring contents */
     page->in_cons = cons;
+    local_irq_restore(flags);
     notify_remote_via_evtchn(dev->evtchn);
 
 #ifdef HAVE_LIBC
@@ -367,6 +373,7 @@ int fbfront_receive(struct fbfront_dev *dev, union xenfb_in_event *buf, int n)
 {
     struct xenfb_page *page = dev->page;
     uint32_t prod, cons;
+    unsigned long flags;
     int i;
 
 #ifdef HAVE_LIBC
@@ -376,10 +383,14 @@ int fbfront_receive(struct fbfront_dev *dev, union xenfb_in_event *buf, int n)
     }
 #endif
 
+    /* Readers preempting each other must not get the same events */
+    local_irq_save(flags);
     prod = page->in_prod;
 
-    if (prod == page->in_cons)
+    if (prod == page->in_cons) {
+        local_irq_restore(flags);
         return 0;
+    }
 
     rmb();      /* ensure we see ring contents up to prod */
 
@@ -388,6 +399,7 @@ int fbfront_receive(struct fbfront_dev *dev, union xenfb_in_event *buf, int n)
 
     mb();       /* ensure we got ring contents */
     page->in_cons = cons;
+    local_irq_restore(flags);
     notify_remote_via_evtchn(dev->evtchn);
 
 #ifdef HAVE_LIBC
@@ -565,12 +577,19 @@ error:
 static void fbfront_out_event(struct fbfront_dev *dev, union xenfb_out_event *event)
 {
     struct xenfb_page *page = dev->page;
+    unsigned long flags;
     uint32_t prod;
     DEFINE_WAIT(w);
 
-    add_waiter(w, fbfront_queue);
-    while (page->out_prod - page->out_cons == XENFB_OUT_RING_LEN)
+    /* Not to be preempted by another sender between the check and the
+     * update of out_prod */
+    local_irq_save(flags);
+    while (page->out_prod - page->out_cons == XENFB_OUT_RING_LEN) {
+        add_waiter(w, fbfront_queue);
+        local_irq_restore(flags);
         schedule();
+        local_irq_save(flags);
+    }
     remove_waiter(w, fbfront_queue);
 
     prod = page->out_prod;
@@ -578,6 +597,7 @@ static void fbfront_out_event(struct fbfront_dev *dev, union xenfb_out_event *ev
     XENFB_OUT_RING_REF(page, prod) = *event;
     wmb(); /* ensure ring contents visible */
     page->out_prod = prod + 1;
+    local_irq_restore(flags);
     notify_remote_via_evtchn(dev->evtchn);
 }
 
@@ -45,6 +45,11 @@ void do_hypervisor_callback(struct pt_regs *regs)
     vcpu_info_t   *vcpu_info = &s->vcpu_info[cpu];
 
     in_callback = 1;
+#if defined(__x86_64__)
+    /* Upcalls from the event entry point run on the IRQ stack */
+    if (regs)
+        irqstack_set_current(*(void **)((unsigned long)regs & ~(STACK_SIZE - 1)));
+#endif
    
     vcpu_info->evtchn_upcall_pending = 0;
     /* NB x86. No need for a barrier here -- XCHG is a barrier on x86. */
@@ -2,12 +2,20 @@
 #include <xen/io/blkif.h>
 #include <mini-os/types.h>
 struct blkfront_dev;
+struct blkfront_iov
+{
+    void *iov_base;
+    size_t iov_len;
+};
 struct blkfront_aiocb
 {
     struct blkfront_dev *aio_dev;
     uint8_t *aio_buf;
     size_t aio_nbytes;
     off_t aio_offset;
+    /* Used instead of aio_buf when it is NULL, aio_nbytes is then computed */
+    struct blkfront_iov *aio_iov;
+    int aio_iovcnt;
     size_t total_bytes;
     uint8_t is_write;
     void *data;
@@ -16,29 +24,167 @@ struct blkfront_aiocb
     int n;
 
     void (*aio_cb)(struct blkfront_aiocb *aiocb, int ret);
+
+    /* Thread to wake when the response arrives */
+    struct thread *waiter;
+    /* When the last request was queued, for latency statistics */
+    s_time_t submit_time;
+    /* Mapped pages kept resident while granted, see blkfront_map_pin */
+    void *pinned[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    int nr_pinned;
+    /* While a write is in flight, see blkfront_write_begin */
+    void (*write_cb)(struct blkfront_aiocb *aiocb, int ret);
+    MINIOS_TAILQ_ENTRY(struct blkfront_aiocb) write_list;
 };
 struct blkfront_info
 {
+    /* In sector_size units */
     uint64_t sectors;
     unsigned sector_size;
+    /* Writes should be aligned on it to avoid read-modify-write cycles */
+    unsigned physical_sector_size;
     int mode;
     int info;
     int barrier;
     int flush;
+    int discard;
+    /* In bytes */
+    unsigned discard_granularity;
+    unsigned discard_alignment;
+    int discard_secure;
+};
+/* Block cache policies */
+#define BLKFRONT_CACHE_WRITETHROUGH 0
+#define BLKFRONT_CACHE_WRITEBACK 1
+struct blkfront_cache_stats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+};
+struct blkfront_readahead_stats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long wasted;
+    /* Current window, in bytes */
+    unsigned long window;
 };
 struct blkfront_dev *init_blkfront(char *nodename, struct blkfront_info *info);
 #ifdef HAVE_LIBC
 int blkfront_open(struct blkfront_dev *dev);
 #endif
+/* Submitting aios may sleep for a ring slot or a grant entry, so it must be
+ * done by a thread with events enabled, which includes aio callbacks.  It
+ * only waits for other requests to complete to keep the cache coherent.
+ * Errors, allocation failures included, are reported through aio_cb.  */
 void blkfront_aio(struct blkfront_aiocb *aiocbp, int write);
 #define blkfront_aio_read(aiocbp) blkfront_aio(aiocbp, 0)
 #define blkfront_aio_write(aiocbp) blkfront_aio(aiocbp, 1)
+/* Issue aiocbs[i] according to their is_write field, notifying the backend
+ * only once.  */
+void blkfront_aio_submit(struct blkfront_dev *dev, struct blkfront_aiocb *aiocbs[], int n);
 void blkfront_io(struct blkfront_aiocb *aiocbp, int write);
 #define blkfront_read(aiocbp) blkfront_io(aiocbp, 0)
 #define blkfront_write(aiocbp) blkfront_io(aiocbp, 1)
+/* Return the number of bytes transferred, or a negative errno value */
+ssize_t blkfront_pread(struct blkfront_dev *dev, void *buf, size_t nbytes, off_t offset);
+ssize_t blkfront_pwrite(struct blkfront_dev *dev, const void *buf, size_t nbytes, off_t offset);
+void blkfront_get_info(struct blkfront_dev *dev, struct blkfront_info *info);
+void blkfront_aio_discard(struct blkfront_aiocb *aiocbp, int secure);
 void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op);
 int blkfront_aio_poll(struct blkfront_dev *dev);
-void blkfront_sync(struct blkfront_dev *dev);
+int blkfront_sync(struct blkfront_dev *dev);
 void shutdown_blkfront(struct blkfront_dev *dev);
+/* Cache blkfront_io requests in at most budget bytes of memory.  */
+int blkfront_cache_enable(struct blkfront_dev *dev, size_t budget, int policy);
+/* Fails, keeping the cache, if dirty blocks cannot be written back */
+int blkfront_cache_disable(struct blkfront_dev *dev);
+void blkfront_cache_get_stats(struct blkfront_dev *dev, struct blkfront_cache_stats *stats);
+/* Limit sequential readahead to max bytes, 0 disables it.  */
+int blkfront_set_readahead(struct blkfront_dev *dev, size_t max);
+void blkfront_get_readahead_stats(struct blkfront_dev *dev, struct blkfront_readahead_stats *stats);
+
+/* I/O statistics */
+#define BLKFRONT_STAT_READ	0
+#define BLKFRONT_STAT_WRITE	1
+/* Barriers and cache flushes */
+#define BLKFRONT_STAT_FLUSH	2
+#define BLKFRONT_STAT_DISCARD	3
+#define BLKFRONT_STAT_OPS	4
+/* Bucket b counts latencies below 2^(b+1) microseconds and, but for the
+ * first one, at least 2^b; the last one counts everything above.  */
+#define BLKFRONT_LAT_BUCKETS	24
+/* Same for the number of requests in flight */
+#define BLKFRONT_DEPTH_BUCKETS	8
+struct blkfront_op_stats
+{
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t completed;
+    uint64_t errors;
+    /* From queueing on the ring to the response, in ns */
+    s_time_t lat_total;
+    s_time_t lat_max;
+    uint64_t lat_hist[BLKFRONT_LAT_BUCKETS];
+};
+struct blkfront_iostat
+{
+    struct blkfront_op_stats op[BLKFRONT_STAT_OPS];
+    /* Sampled each time a request is queued, including it */
+    uint64_t depth_samples;
+    uint64_t depth_total;
+    unsigned depth_max;
+    uint64_t depth_hist[BLKFRONT_DEPTH_BUCKETS];
+};
+void blkfront_get_iostat(struct blkfront_dev *dev, struct blkfront_iostat *stat);
+void blkfront_reset_iostat(struct blkfront_dev *dev);
+void blkfront_dump_iostat(struct blkfront_dev *dev);
+void blkfront_set_iostat_interval(struct blkfront_dev *dev, s_time_t interval);
+
+#ifndef __ia64__
+/* Demand-paged mappings, errors are returned as ERR_PTR/-errno */
+void *blkfront_mmap(struct blkfront_dev *dev, size_t length, off_t offset, int writable);
+int blkfront_msync(void *addr, size_t length, int sync);
+int blkfront_munmap(void *addr, size_t length);
+int blkfront_map_pin(const void *buf, size_t len, int write);
+void blkfront_map_unpin(const void *buf, size_t len);
+int blkfront_map_fault(unsigned long addr, int write);
+#else
+/* No demand mapping area on ia64, so nothing is ever mapped */
+static inline int blkfront_map_pin(const void *buf, size_t len, int write) { return 0; }
+static inline void blkfront_map_unpin(const void *buf, size_t len) { }
+#endif
+
+/* Completion ring interface.  Reads and writes must be sector-aligned and
+ * fit in one request, and discards sector-aligned, or they complete with
+ * -EINVAL.  */
+struct blkfront_sqe
+{
+    /* BLKIF_OP_READ, BLKIF_OP_WRITE, BLKIF_OP_WRITE_BARRIER,
+     * BLKIF_OP_FLUSH_DISKCACHE or BLKIF_OP_DISCARD */
+    uint8_t op;
+    uint8_t *buf;
+    size_t nbytes;
+    off_t offset;
+    /* Used instead of buf when it is NULL */
+    struct blkfront_iov *iov;
+    int iovcnt;
+    uint64_t user_data;
+};
+struct blkfront_cqe
+{
+    uint64_t user_data;
+    int res;
+};
+struct blkfront_ioring;
+struct blkfront_ioring *blkfront_ioring_init(struct blkfront_dev *dev, unsigned entries);
+void blkfront_ioring_fini(struct blkfront_ioring *ring);
+struct blkfront_sqe *blkfront_ioring_get_sqe(struct blkfront_ioring *ring);
+int blkfront_ioring_submit(struct blkfront_ioring *ring);
+struct blkfront_cqe *blkfront_ioring_peek_cqe(struct blkfront_ioring *ring);
+void blkfront_ioring_cqe_seen(struct blkfront_ioring *ring);
+unsigned blkfront_ioring_wait_cqes(struct blkfront_ioring *ring, unsigned nr, s_time_t deadline);
 
 extern struct wait_queue_head blkfront_queue;
@@ -38,6 +38,9 @@ int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
 							evtchn_handler_t handler, void *data,
 							evtchn_port_t *local_port);
 void unbind_all_ports(void);
+#if defined(__x86_64__)
+void irqstack_set_current(void *thread);
+#endif
 
 static inline int notify_remote_via_evtchn(evtchn_port_t port)
 {
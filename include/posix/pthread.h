@@ -2,62 +2,114 @@
 #define _POSIX_PTHREAD_H
 
 #include <stdlib.h>
+#include <time.h>
+#include <mini-os/arch_limits.h>
+#include <mini-os/waittypes.h>
 
-/* Let's be single-threaded for now.  */
+/*
+ * POSIX threads on top of Mini-OS threads, see lib/pthread.c.  Threads are
+ * not preempted unless Mini-OS is built with CONFIG_PREEMPT, and there is
+ * no thread-local storage: __thread variables are shared.
+ */
+
+struct pthread;
+typedef struct pthread *pthread_t;
+
+#define PTHREAD_CREATE_JOINABLE 0
+#define PTHREAD_CREATE_DETACHED 1
+
+#define PTHREAD_STACK_MIN (2 * __PAGE_SIZE)
 
 typedef struct {
-    void *ptr;
-} *pthread_key_t;
-static inline int pthread_key_create(pthread_key_t *key, void (*destr_function)(void*))
-{
-    *key = malloc(sizeof(**key));
-    (*key)->ptr = NULL;
-    return 0;
-}
-static inline int pthread_setspecific(pthread_key_t key, const void *pointer)
-{
-    key->ptr = (void*) pointer;
-    return 0;
-}
-static inline void *pthread_getspecific(pthread_key_t key)
-{
-    return key->ptr;
-}
-static inline int pthread_key_delete(pthread_key_t key)
-{
-    free(key);
-    return 0;
-}
-
-
-
-typedef struct {} pthread_mutexattr_t;
-static inline int pthread_mutexattr_init(pthread_mutexattr_t *mattr) { return 0; }
+    /* 0 for the default, the largest */
+    size_t stacksize;
+    int detachstate;
+} pthread_attr_t;
+
+int pthread_attr_init(pthread_attr_t *attr);
+int pthread_attr_destroy(pthread_attr_t *attr);
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate);
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate);
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize);
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize);
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg);
+void pthread_exit(void *retval) __attribute__((noreturn));
+int pthread_join(pthread_t thread, void **retval);
+int pthread_detach(pthread_t thread);
+pthread_t pthread_self(void);
+int pthread_equal(pthread_t t1, pthread_t t2);
+int pthread_yield(void);
+
+#define PTHREAD_KEYS_MAX 64
+#define PTHREAD_DESTRUCTOR_ITERATIONS 4
+
+typedef unsigned int pthread_key_t;
+int pthread_key_create(pthread_key_t *key, void (*destr_function)(void *));
+int pthread_key_delete(pthread_key_t key);
+int pthread_setspecific(pthread_key_t key, const void *pointer);
+void *pthread_getspecific(pthread_key_t key);
+
 #define PTHREAD_MUTEX_NORMAL 0
 #define PTHREAD_MUTEX_RECURSIVE 1
-static inline int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind) { return 0; }
-static inline int pthread_mutexattr_destroy(pthread_mutexattr_t *mattr) { return 0; }
-typedef struct {} pthread_mutex_t;
-#define PTHREAD_MUTEX_INITIALIZER {}
-static inline int pthread_mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *mattr) { return 0; }
-static inline int pthread_mutex_lock(pthread_mutex_t *mutex) { return 0; }
-static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) { return 0; }
+#define PTHREAD_MUTEX_ERRORCHECK 2
+#define PTHREAD_MUTEX_DEFAULT PTHREAD_MUTEX_NORMAL
 
+typedef struct {
+    int type;
+} pthread_mutexattr_t;
+int pthread_mutexattr_init(pthread_mutexattr_t *mattr);
+int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind);
+int pthread_mutexattr_gettype(const pthread_mutexattr_t *mattr, int *kind);
+int pthread_mutexattr_destroy(pthread_mutexattr_t *mattr);
+
+/* The wait queues of statically initialized mutexes and condition
+ * variables are initialized on first wait. */
+typedef struct {
+    int type;
+    struct thread *owner;
+    int count;
+    struct wait_queue_head wait;
+} pthread_mutex_t;
+#define PTHREAD_MUTEX_INITIALIZER { .type = PTHREAD_MUTEX_NORMAL }
+#define PTHREAD_RECURSIVE_MUTEX_INITIALIZER { .type = PTHREAD_MUTEX_RECURSIVE }
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *mattr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+typedef struct {
+    clockid_t clock;
+} pthread_condattr_t;
+int pthread_condattr_init(pthread_condattr_t *attr);
+int pthread_condattr_destroy(pthread_condattr_t *attr);
+int pthread_condattr_setclock(pthread_condattr_t *attr, clockid_t clock);
+int pthread_condattr_getclock(const pthread_condattr_t *attr, clockid_t *clock);
+
+typedef struct {
+    clockid_t clock;
+    struct wait_queue_head wait;
+} pthread_cond_t;
+#define PTHREAD_COND_INITIALIZER { .clock = CLOCK_REALTIME }
 
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime);
 
 typedef struct {
-    int done;
+    /* 0, 1 while init_routine runs, 2 once done */
+    int state;
 } pthread_once_t;
 #define PTHREAD_ONCE_INIT { 0 }
 
-static inline int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
-{
-    if (!once_control->done) {
-        once_control->done = 1;
-        init_routine();
-    }
-    return 0;
-}
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void));
 
 #define __thread
 
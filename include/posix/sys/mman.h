@@ -14,8 +14,13 @@
 
 #define MAP_FAILED	((void*)0)
 
+#define MS_ASYNC	0x1
+#define MS_INVALIDATE	0x2
+#define MS_SYNC		0x4
+
 void *mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset) asm("mmap64");
 int munmap(void *start, size_t length);
+int msync(void *addr, size_t length, int flags);
 static inline mlock(const void *addr, size_t len) { return 0; }
 static inline munlock(const void *addr, size_t len) { return 0; }
 
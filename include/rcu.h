@@ -0,0 +1,45 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <mini-os/os.h>
+#include <mini-os/sched.h>
+
+/*
+ * Read-copy update, for read-mostly data such as lists and tables: readers
+ * take no lock, and writers replace or unlink elements with
+ * rcu_assign_pointer(), then free the old ones only once every reader
+ * which could still see them is done, with call_rcu() or synchronize_rcu().
+ * Writers still serialize among themselves.
+ *
+ * Read-side sections must not block; the running thread is not preempted
+ * in them.  Any call to schedule() is thus a quiescent state: with a single
+ * CPU, no reader can be running across it.  Event handlers may read too.
+ */
+
+struct rcu_head
+{
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+#define rcu_read_lock() preempt_disable()
+#define rcu_read_unlock() preempt_enable()
+
+/* Load a pointer to read under rcu_read_lock() */
+#define rcu_dereference(p) ({                                   \
+    __typeof__(p) _p = *(volatile __typeof__(p) *)&(p);         \
+    barrier();                                                  \
+    _p;                                                         \
+})
+/* Publish v, initialized before, to readers */
+#define rcu_assign_pointer(p, v) do { wmb(); (p) = (v); } while (0)
+
+/* Call func once the readers which may see the element are done.  func
+ * runs in thread context from schedule(), and must not block. */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+/* Wait for the readers which may see unlinked elements */
+void synchronize_rcu(void);
+/* Called by schedule() */
+void rcu_quiescent_state(void);
+
+#endif /* __RCU_H__ */
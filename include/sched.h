@@ -3,15 +3,35 @@
 
 #include <mini-os/list.h>
 #include <mini-os/time.h>
+#include <mini-os/timer.h>
 #include <mini-os/arch_sched.h>
 #ifdef HAVE_LIBC
 #include <sys/reent.h>
 #endif
 
+/* Scheduling statistics, times in ns */
+struct thread_stats
+{
+    s_time_t run_time;
+    /* Runnable, waiting for the CPU */
+    s_time_t wait_time;
+    s_time_t wait_max;
+    s_time_t block_time;
+    /* Switched out while blocked, and while still runnable */
+    unsigned long voluntary;
+    unsigned long forced;
+    unsigned long wakeups;
+};
+
 struct thread
 {
     char *name;
     char *stack;
+    /* STACK_SIZE, or less with create_thread_ex() */
+    unsigned long stack_size;
+    /* Lowest usable address, the stack is filled with STACK_FILL from there
+     * when created.  NULL if the architecture does not track stack use. */
+    char *stack_limit;
 #if !defined(__ia64__)
     /* keep in that order */
     unsigned long sp;  /* Stack pointer */
@@ -20,10 +40,20 @@ struct thread
     thread_regs_t regs;
 #endif /* !defined(__ia64__) */
     MINIOS_TAILQ_ENTRY(struct thread) thread_list;
+    MINIOS_TAILQ_ENTRY(struct thread) run_list;
     uint32_t flags;
+    /* THREAD_PRIO_*, lower runs first */
+    int prio;
     s_time_t wakeup_time;
+    /* Armed at wakeup_time while blocked */
+    struct timer timer;
+    /* Time of the last switch in or out, or wakeup */
+    s_time_t stamp;
+    struct thread_stats stats;
 #ifdef HAVE_LIBC
     struct _reent reent;
+    /* Its struct pthread, once it used the pthread API */
+    void *pthread;
 #endif
 };
 
@@ -31,6 +61,20 @@ extern struct thread *idle_thread;
 void idle_thread_fn(void *unused);
 
 #define RUNNABLE_FLAG   0x00000001
+/* On the run queue, possibly no longer runnable */
+#define RUNQ_FLAG       0x00000002
+/* Reported as about to overflow its stack */
+#define STACK_WARNED_FLAG 0x00000004
+/* Serving a page fault on a block device mapping */
+#define MAP_FAULT_FLAG  0x00000008
+
+/* Scheduling priorities, runnable threads of a higher priority always run
+ * first.  Latency-sensitive threads such as xenstore and the network input
+ * thread use THREAD_PRIO_HIGH, and they must not hog the CPU.  */
+#define THREAD_PRIO_HIGH    0
+#define THREAD_PRIO_NORMAL  1
+#define THREAD_PRIO_LOW     2
+#define NR_THREAD_PRIO      3
 
 #define is_runnable(_thread)    (_thread->flags & RUNNABLE_FLAG)
 #define set_runnable(_thread)   (_thread->flags |= RUNNABLE_FLAG)
@@ -38,22 +82,65 @@ void idle_thread_fn(void *unused);
 
 #define switch_threads(prev, next) arch_switch_threads(prev, next)
  
+/* Smallest stack create_thread_ex() hands out */
+#define THREAD_STACK_MIN (2 * PAGE_SIZE)
+#define STACK_FILL 0xa5
+
     /* Architecture specific setup of thread creation. */
 struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data);
+                                  void *data, char *stack,
+                                  unsigned long stack_size);
+char *arch_alloc_stack(unsigned long size);
+void arch_free_stack(char *stack, unsigned long size);
+/* Bytes of a stack of that size which the thread may use */
+unsigned long arch_stack_usable(unsigned long size);
 
 void init_sched(void);
 void run_idle_thread(void);
 struct thread* create_thread(char *name, void (*function)(void *), void *data);
+struct thread* create_thread_ex(char *name, void (*function)(void *), void *data,
+                                unsigned long stack_size);
+/* Usable size of the stack create_thread_ex() gives for stack_size */
+unsigned long thread_stack_size(unsigned long stack_size);
 void exit_thread(void) __attribute__((noreturn));
+int set_thread_priority(struct thread *thread, int prio);
 void schedule(void);
+void print_thread_stats(void);
+unsigned long thread_stack_used(struct thread *thread);
 
 #ifdef __INSIDE_MINIOS__
 #define current get_current()
 #endif
 
+#ifdef CONFIG_PREEMPT
+#ifdef __ia64__
+#error "CONFIG_PREEMPT is not supported on ia64"
+#endif
+void set_sched_slice(s_time_t slice);
+void sched_tick(void);
+void preempt_schedule_irq(void);
+void preempt_check_resched(void);
+
+/* The running thread is not preempted until the matching preempt_enable(),
+ * it must not block meanwhile. */
+extern int preempt_count;
+#define preempt_disable() do { preempt_count++; barrier(); } while (0)
+#define preempt_enable() do {                                   \
+    barrier();                                                  \
+    if (!--preempt_count)                                       \
+        preempt_check_resched();                                \
+} while (0)
+#else
+#define preempt_disable() barrier()
+#define preempt_enable() barrier()
+#endif
+
 void wake(struct thread *thread);
 void block(struct thread *thread);
 void msleep(uint32_t millisecs);
+#ifdef HAVE_LIBC
+/* Called by exit_thread() for threads which used the pthread API */
+void pthread_thread_exit(struct thread *thread);
+#endif
 
 #endif /* __SCHED_H__ */
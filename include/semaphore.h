@@ -16,12 +16,14 @@ struct semaphore
 };
 
 /*
- * the semaphore definition
+ * Reader-writer semaphore.  Writers have preference: once a writer waits,
+ * new readers wait too, so that readers cannot starve it.
  */
 struct rw_semaphore {
-	signed long		count;
-	spinlock_t		wait_lock;
-	int			debug;
+	/* Number of readers holding it, -1 when held for writing */
+	int activity;
+	int waiting_writers;
+	struct wait_queue_head wait;
 };
 
 #define __SEMAPHORE_INITIALIZER(name, n)                            \
@@ -48,6 +50,16 @@ static inline void init_SEMAPHORE(struct semaphore *sem, int count)
 
 #define init_MUTEX(sem) init_SEMAPHORE(sem, 1)
 
+#define __RWSEM_INITIALIZER(name)                                   \
+{                                                                   \
+    .activity = 0,                                                  \
+    .waiting_writers = 0,                                           \
+    .wait = __WAIT_QUEUE_HEAD_INITIALIZER((name).wait)              \
+}
+
+#define DECLARE_RWSEM(name) \
+    struct rw_semaphore name = __RWSEM_INITIALIZER(name)
+
 static inline int trydown(struct semaphore *sem)
 {
     unsigned long flags;
@@ -65,7 +77,7 @@ static void inline down(struct semaphore *sem)
 {
     unsigned long flags;
     while (1) {
-        wait_event(sem->wait, sem->count > 0);
+        wait_event_exclusive(sem->wait, sem->count > 0);
         local_irq_save(flags);
         if (sem->count > 0)
             break;
@@ -80,31 +92,103 @@ static void inline up(struct semaphore *sem)
     unsigned long flags;
     local_irq_save(flags);
     sem->count++;
-    wake_up(&sem->wait);
+    wake_up_one(&sem->wait);
     local_irq_restore(flags);
 }
 
-/* FIXME! Thre read/write semaphores are unimplemented! */
 static inline void init_rwsem(struct rw_semaphore *sem)
 {
-  sem->count = 1;
+    sem->activity = 0;
+    sem->waiting_writers = 0;
+    init_waitqueue_head(&sem->wait);
 }
 
-static inline void down_read(struct rw_semaphore *sem)
+#define rwsem_can_read(sem) ((sem)->activity >= 0 && !(sem)->waiting_writers)
+
+static inline int down_read_trylock(struct rw_semaphore *sem)
 {
+    unsigned long flags;
+    int ret = 0;
+    local_irq_save(flags);
+    if (rwsem_can_read(sem)) {
+        ret = 1;
+        sem->activity++;
+    }
+    local_irq_restore(flags);
+    return ret;
 }
 
+static inline void down_read(struct rw_semaphore *sem)
+{
+    unsigned long flags;
+    while (1) {
+        wait_event(sem->wait, rwsem_can_read(sem));
+        local_irq_save(flags);
+        if (rwsem_can_read(sem))
+            break;
+        local_irq_restore(flags);
+    }
+    sem->activity++;
+    local_irq_restore(flags);
+}
 
 static inline void up_read(struct rw_semaphore *sem)
 {
+    unsigned long flags;
+    local_irq_save(flags);
+    if (!--sem->activity)
+        wake_up(&sem->wait);
+    local_irq_restore(flags);
 }
 
-static inline void up_write(struct rw_semaphore *sem)
+static inline int down_write_trylock(struct rw_semaphore *sem)
 {
+    unsigned long flags;
+    int ret = 0;
+    local_irq_save(flags);
+    if (!sem->activity) {
+        ret = 1;
+        sem->activity = -1;
+    }
+    local_irq_restore(flags);
+    return ret;
 }
 
 static inline void down_write(struct rw_semaphore *sem)
 {
+    unsigned long flags;
+    local_irq_save(flags);
+    sem->waiting_writers++;
+    local_irq_restore(flags);
+    while (1) {
+        wait_event(sem->wait, !sem->activity);
+        local_irq_save(flags);
+        if (!sem->activity)
+            break;
+        local_irq_restore(flags);
+    }
+    sem->waiting_writers--;
+    sem->activity = -1;
+    local_irq_restore(flags);
+}
+
+static inline void up_write(struct rw_semaphore *sem)
+{
+    unsigned long flags;
+    local_irq_save(flags);
+    sem->activity = 0;
+    wake_up(&sem->wait);
+    local_irq_restore(flags);
+}
+
+/* Let readers in, and keep reading */
+static inline void downgrade_write(struct rw_semaphore *sem)
+{
+    unsigned long flags;
+    local_irq_save(flags);
+    sem->activity = 1;
+    wake_up(&sem->wait);
+    local_irq_restore(flags);
 }
 
 #endif /* _SEMAPHORE_H */
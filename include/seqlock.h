@@ -0,0 +1,85 @@
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <mini-os/os.h>
+#include <mini-os/spinlock.h>
+#include <mini-os/sched.h>
+
+/*
+ * Sequence locks, for small data read often and written rarely, such as
+ * statistics or a time base: readers take no lock but retry if a writer
+ * ran meanwhile, writers are never delayed by readers.
+ *
+ *   do {
+ *       seq = read_seqbegin(&lock);
+ *       copy = data;
+ *   } while (read_seqretry(&lock, seq));
+ *
+ * A reader spins while a write is in progress, so a writer must not be
+ * interrupted by readers: use the _irqsave variants if event handlers read
+ * the data.  Readers must not follow pointers which a writer may free.
+ */
+
+typedef struct {
+    volatile unsigned sequence;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_UNLOCKED { .sequence = 0, .lock = SPIN_LOCK_UNLOCKED }
+#define DEFINE_SEQLOCK(x) seqlock_t x = SEQLOCK_UNLOCKED
+
+static inline void seqlock_init(seqlock_t *sl)
+{
+    seqlock_t init = SEQLOCK_UNLOCKED;
+
+    *sl = init;
+}
+
+static inline unsigned read_seqbegin(const seqlock_t *sl)
+{
+    unsigned seq;
+
+    while ((seq = sl->sequence) & 1)
+        barrier();
+    rmb();
+    return seq;
+}
+
+/* Whether the data read since read_seqbegin() may be inconsistent */
+static inline int read_seqretry(const seqlock_t *sl, unsigned seq)
+{
+    rmb();
+    return sl->sequence != seq;
+}
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+    preempt_disable();
+    spin_lock(&sl->lock);
+    sl->sequence++;
+    wmb();
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+    wmb();
+    sl->sequence++;
+    spin_unlock(&sl->lock);
+    preempt_enable();
+}
+
+#define write_seqlock_irqsave(sl, flags) do {   \
+    local_irq_save(flags);                      \
+    spin_lock(&(sl)->lock);                     \
+    (sl)->sequence++;                           \
+    wmb();                                      \
+} while (0)
+
+#define write_sequnlock_irqrestore(sl, flags) do {      \
+    wmb();                                              \
+    (sl)->sequence++;                                   \
+    spin_unlock(&(sl)->lock);                           \
+    local_irq_restore(flags);                           \
+} while (0)
+
+#endif /* __SEQLOCK_H__ */
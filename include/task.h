@@ -0,0 +1,101 @@
+#ifndef __TASK_H__
+#define __TASK_H__
+
+#include <mini-os/list.h>
+#include <mini-os/time.h>
+#include <mini-os/timer.h>
+#include <mini-os/waittypes.h>
+#include <mini-os/events.h>
+
+/*
+ * Tasks are stackless coroutines, run one after the other by a single
+ * executor thread.  The task function runs until it waits for something,
+ * then returns; it is called again from the start when the task is woken,
+ * and uses TASK_BEGIN/TASK_END to resume where it left.  Locals are lost
+ * across waits, state must be kept in the task or its data.
+ *
+ *   static void echo(struct task *task)
+ *   {
+ *       struct echo *e = task->data;
+ *
+ *       TASK_BEGIN(task);
+ *       e->aiocb.aio_cb = task_aio_cb;
+ *       e->aiocb.data = task;
+ *       blkfront_aio_read(&e->aiocb);
+ *       TASK_WAIT(task);
+ *       if (task->result < 0)
+ *           ...
+ *       TASK_SLEEP_UNTIL(task, NOW() + SECONDS(1));
+ *       TASK_END(task);
+ *   }
+ *
+ * Tasks may be woken from event handlers, timers and the completion
+ * callbacks of blkfront and xenbus requests.  Completions which are only
+ * noticed by polling, such as blkfront's, need a task_poller.
+ */
+
+struct task
+{
+    void (*fn)(struct task *task);
+    void *data;
+    /* Where to resume, TASK_DONE once finished */
+    int state;
+    /* Of what the task waited for */
+    int result;
+    void *reply;
+    int flags;
+    MINIOS_TAILQ_ENTRY(struct task) run_list;
+    struct timer timer;
+};
+
+#define TASK_DONE       -1
+/* Freed once done */
+#define TASK_ALLOCATED  0x1
+#define TASK_QUEUED     0x2
+
+#define TASK_BEGIN(task) switch ((task)->state) { case 0:
+/* Return to the executor, and resume here once woken */
+#define TASK_WAIT(task) do { (task)->state = __LINE__; return; case __LINE__:; } while (0)
+#define TASK_WAIT_UNTIL(task, condition) while (!(condition)) TASK_WAIT(task)
+#define TASK_SLEEP_UNTIL(task, deadline) do {                   \
+    timer_add(&(task)->timer, (deadline));                      \
+    TASK_WAIT_UNTIL(task, !timer_pending(&(task)->timer));      \
+} while (0)
+#define TASK_END(task) } (task)->state = TASK_DONE
+
+void task_init(struct task *task, void (*fn)(struct task *task), void *data);
+/* xmalloc()ed task, freed by the executor once done */
+struct task *task_create(void (*fn)(struct task *task), void *data);
+/* Queue the task for its first run, starting the executor if needed */
+int task_start(struct task *task);
+/* Queue the task to run again, from any context */
+void task_wake(struct task *task);
+
+/* Event channel handler waking the task given as data */
+void task_evtchn_handler(evtchn_port_t port, struct pt_regs *regs, void *data);
+/* xenbus_msg_reply_async() callback, the task gets the reply */
+struct xsd_sockmsg;
+void task_xenbus_reply(struct xsd_sockmsg *reply, void *data);
+#ifdef CONFIG_BLKFRONT
+/* blkfront aio callback, the task gets the return value */
+struct blkfront_aiocb;
+void task_aio_cb(struct blkfront_aiocb *aiocb, int ret);
+#endif
+
+/*
+ * Called by the executor before it waits on queue, e.g. blkfront_aio_poll on
+ * blkfront_queue, to run the completion callbacks which wake tasks.
+ */
+struct task_poller
+{
+    void (*poll)(void *data);
+    void *data;
+    struct wait_queue_head *queue;
+    struct wait_queue waiter;
+    MINIOS_TAILQ_ENTRY(struct task_poller) list;
+};
+
+void task_add_poller(struct task_poller *poller);
+void task_remove_poller(struct task_poller *poller);
+
+#endif /* __TASK_H__ */
@@ -58,6 +58,11 @@ void     fini_time(void);
 s_time_t get_s_time(void);
 s_time_t get_v_time(void);
 uint64_t monotonic_clock(void);
+/* 0 blocks until the next event */
 void     block_domain(s_time_t until);
+/* Arm the one-shot hypervisor timer, 0 disarms it (x86 only) */
+void     set_timer(s_time_t until);
+/* Same, unless it is already armed to fire no later (x86 only) */
+void     set_timer_before(s_time_t until);
 
 #endif /* _MINIOS_TIME_H_ */
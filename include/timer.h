@@ -0,0 +1,38 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <mini-os/time.h>
+
+/*
+ * Kernel timers.  Expired timers are run by schedule(), with IRQs disabled:
+ * the function must not block, but may wake threads up or re-arm the timer.
+ * Timers may be armed and deleted from event handlers.
+ */
+struct timer
+{
+    s_time_t expires;
+    void (*function)(void *data);
+    void *data;
+    int pending;
+    /* Pairing heap links: first child, next sibling, and previous sibling
+     * or parent for the first child */
+    struct timer *child, *next, *prev;
+};
+
+#define TIMER_INITIALIZER(_function, _data) { .function = (_function), .data = (_data) }
+
+void init_timer(struct timer *timer, void (*function)(void *data), void *data);
+/* Arm the timer, or move it if it is already pending */
+void timer_add(struct timer *timer, s_time_t expires);
+/* Same, but return whether the timer was pending */
+int timer_mod(struct timer *timer, s_time_t expires);
+/* Return whether the timer was pending */
+int timer_del(struct timer *timer);
+#define timer_pending(timer) ((timer)->pending)
+
+/* Earliest expiry, 0 if no timer is pending */
+s_time_t timer_next(void);
+/* Run the timers expired at now */
+void timer_run(s_time_t now);
+
+#endif /* __TIMER_H__ */
@@ -9,6 +9,7 @@
 struct wait_queue name = {                         \
     .thread       = get_current(),                 \
     .waiting      = 0,                             \
+    .exclusive    = 0,                             \
 }
 
 
@@ -21,16 +22,27 @@ static inline void init_waitqueue_entry(struct wait_queue *q, struct thread *thr
 {
     q->thread = thread;
     q->waiting = 0;
+    q->exclusive = 0;
 }
 
+/* Exclusive waiters go last, after those which are all woken */
 static inline void add_wait_queue(struct wait_queue_head *h, struct wait_queue *q)
 {
     if (!q->waiting) {
-        MINIOS_STAILQ_INSERT_HEAD(h, q, thread_list);
+        if (q->exclusive)
+            MINIOS_STAILQ_INSERT_TAIL(h, q, thread_list);
+        else
+            MINIOS_STAILQ_INSERT_HEAD(h, q, thread_list);
         q->waiting = 1;
     }
 }
 
+static inline void add_wait_queue_exclusive(struct wait_queue_head *h, struct wait_queue *q)
+{
+    q->exclusive = 1;
+    add_wait_queue(h, q);
+}
+
 static inline void remove_wait_queue(struct wait_queue_head *h, struct wait_queue *q)
 {
     if (q->waiting) {
@@ -49,6 +61,30 @@ static inline void wake_up(struct wait_queue_head *head)
     local_irq_restore(flags);
 }
 
+/*
+ * Wake all the non-exclusive waiters, and the first nr exclusive ones.  The
+ * exclusive waiters woken are removed from the queue, so that another wake
+ * up before they run goes to the next one; they re-add themselves if they
+ * have to wait again.
+ */
+static inline void wake_up_nr(struct wait_queue_head *head, int nr)
+{
+    unsigned long flags;
+    struct wait_queue *curr, *tmp;
+    local_irq_save(flags);
+    MINIOS_STAILQ_FOREACH_SAFE(curr, head, thread_list, tmp) {
+        wake(curr->thread);
+        if (curr->exclusive) {
+            remove_wait_queue(head, curr);
+            if (!--nr)
+                break;
+        }
+    }
+    local_irq_restore(flags);
+}
+
+#define wake_up_one(head) wake_up_nr(head, 1)
+
 #define add_waiter(w, wq) do {  \
     unsigned long flags;        \
     local_irq_save(flags);      \
@@ -57,6 +93,14 @@ static inline void wake_up(struct wait_queue_head *head)
     local_irq_restore(flags);   \
 } while (0)
 
+#define add_waiter_exclusive(w, wq) do {    \
+    unsigned long flags;                    \
+    local_irq_save(flags);                  \
+    add_wait_queue_exclusive(&wq, &w);      \
+    block(get_current());                   \
+    local_irq_restore(flags);               \
+} while (0)
+
 #define remove_waiter(w, wq) do {  \
     unsigned long flags;           \
     local_irq_save(flags);         \
@@ -64,11 +108,12 @@ static inline void wake_up(struct wait_queue_head *head)
     local_irq_restore(flags);      \
 } while (0)
 
-#define wait_event_deadline(wq, condition, deadline) do {       \
+#define __wait_event_deadline(wq, condition, deadline, excl) do {\
     unsigned long flags;                                        \
     DEFINE_WAIT(__wait);                                        \
     if(condition)                                               \
         break;                                                  \
+    __wait.exclusive = excl;                                    \
     for(;;)                                                     \
     {                                                           \
         /* protect the list */                                  \
@@ -88,7 +133,13 @@ static inline void wake_up(struct wait_queue_head *head)
     local_irq_restore(flags);                                   \
 } while(0) 
 
+#define wait_event_deadline(wq, condition, deadline) \
+    __wait_event_deadline(wq, condition, deadline, 0)
 #define wait_event(wq, condition) wait_event_deadline(wq, condition, 0) 
+/* The waker must use wake_up_one() or wake_up_nr() once per thread which
+ * may proceed, and the condition must not time out. */
+#define wait_event_exclusive(wq, condition) \
+    __wait_event_deadline(wq, condition, 0, 1)
 
 
 
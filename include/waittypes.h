@@ -7,6 +7,8 @@ struct thread;
 struct wait_queue
 {
     int waiting;
+    /* Woken one at a time, see wake_up_nr() */
+    int exclusive;
     struct thread *thread;
     MINIOS_STAILQ_ENTRY(struct wait_queue) thread_list;
 };
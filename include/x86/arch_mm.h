@@ -119,6 +119,8 @@ typedef unsigned long pgentry_t;
 #define _PAGE_PAT      0x080ULL
 #define _PAGE_PSE      0x080ULL
 #define _PAGE_GLOBAL   0x100ULL
+/* Software bit for reserved, not present, demand mapping area entries */
+#define _PAGE_ONDEMAND 0x200ULL
 
 #if defined(__i386__)
 #define L1_PROT (_PAGE_PRESENT|_PAGE_RW|_PAGE_ACCESSED)
@@ -230,5 +232,6 @@ static __inline__ paddr_t machine_to_phys(maddr_t machine)
 
 pgentry_t *need_pgt(unsigned long addr);
 int mfn_is_ram(unsigned long mfn);
+int reserve_frames(unsigned long va, unsigned long num_frames);
 
 #endif /* _ARCH_MM_H_ */
@@ -63,6 +63,16 @@ xenbus_msg_reply(int type,
                  struct write_req *io,
                  int nr_reqs);
 
+/* Same as xenbus_msg_reply, but return without waiting.  fn is called
+   from the xenstore thread with the reply, which it should free, and must
+   not block.  Only blocks if too many requests are in flight. */
+typedef void (*xenbus_reply_fn_t)(struct xsd_sockmsg *reply, void *data);
+void xenbus_msg_reply_async(int type,
+                            xenbus_transaction_t trans,
+                            struct write_req *io,
+                            int nr_reqs,
+                            xenbus_reply_fn_t fn, void *data);
+
 /* Removes the value associated with a path.  Returns a malloc'd error
    string on failure. */
 char *xenbus_rm(xenbus_transaction_t xbt, const char *path);
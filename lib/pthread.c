@@ -0,0 +1,538 @@
+/*
+ * POSIX threads
+ *
+ * Each pthread is a Mini-OS thread, with its own newlib reent, created with
+ * the requested stack size.  Mutexes and condition variables wait
+ * exclusively, so that unlocking or signalling wakes a single thread.
+ */
+
+#ifdef HAVE_LIBC
+#include <os.h>
+#include <sched.h>
+#include <wait.h>
+#include <lib.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct pthread {
+    struct thread *thread;
+    void *(*start_routine)(void *);
+    void *arg;
+    void *retval;
+    int detached;
+    int exited;
+    struct wait_queue_head join_wait;
+    /* Values are only valid while seq matches the key's */
+    struct {
+        unsigned seq;
+        const void *value;
+    } specific[PTHREAD_KEYS_MAX];
+};
+
+static struct {
+    int in_use;
+    /* Bumped on creation, to forget the values of a deleted key */
+    unsigned seq;
+    void (*destructor)(void *);
+} pthread_keys[PTHREAD_KEYS_MAX];
+
+static DECLARE_WAIT_QUEUE_HEAD(pthread_once_wait);
+
+static struct pthread *pthread_alloc(void)
+{
+    struct pthread *p = calloc(1, sizeof(*p));
+
+    if (p)
+        init_waitqueue_head(&p->join_wait);
+    return p;
+}
+
+/* Wait queues of PTHREAD_*_INITIALIZER objects are zeroed */
+static void pthread_waitq_init(struct wait_queue_head *wq)
+{
+    if (!wq->stqh_last)
+        init_waitqueue_head(wq);
+}
+
+int pthread_attr_init(pthread_attr_t *attr)
+{
+    attr->stacksize = 0;
+    attr->detachstate = PTHREAD_CREATE_JOINABLE;
+    return 0;
+}
+
+int pthread_attr_destroy(pthread_attr_t *attr)
+{
+    return 0;
+}
+
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate)
+{
+    if (detachstate != PTHREAD_CREATE_JOINABLE &&
+        detachstate != PTHREAD_CREATE_DETACHED)
+        return EINVAL;
+    attr->detachstate = detachstate;
+    return 0;
+}
+
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate)
+{
+    *detachstate = attr->detachstate;
+    return 0;
+}
+
+/* The largest stacks lose their base and guard pages */
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize)
+{
+    if (stacksize < PTHREAD_STACK_MIN || stacksize > thread_stack_size(0))
+        return EINVAL;
+    attr->stacksize = stacksize;
+    return 0;
+}
+
+/* What the thread will actually get */
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize)
+{
+    *stacksize = thread_stack_size(attr->stacksize);
+    return 0;
+}
+
+static void pthread_start(void *data)
+{
+    struct pthread *self = data;
+
+    get_current()->pthread = self;
+    pthread_exit(self->start_routine(self->arg));
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg)
+{
+    struct pthread *p = pthread_alloc();
+
+    if (!p)
+        return EAGAIN;
+    p->start_routine = start_routine;
+    p->arg = arg;
+    p->detached = attr && attr->detachstate == PTHREAD_CREATE_DETACHED;
+    *thread = p;
+    p->thread = create_thread_ex("pthread", pthread_start, p,
+                                 attr ? attr->stacksize : 0);
+    if (!p->thread) {
+        free(p);
+        return EAGAIN;
+    }
+    return 0;
+}
+
+/* Threads which were not created by pthread_create get a detached struct
+ * pthread on their first use of the API, NULL if it cannot be allocated. */
+pthread_t pthread_self(void)
+{
+    struct thread *thread = get_current();
+
+    if (!thread->pthread) {
+        struct pthread *p = pthread_alloc();
+
+        if (!p)
+            return NULL;
+        p->thread = thread;
+        p->detached = 1;
+        thread->pthread = p;
+    }
+    return thread->pthread;
+}
+
+int pthread_equal(pthread_t t1, pthread_t t2)
+{
+    return t1 == t2;
+}
+
+int pthread_yield(void)
+{
+    schedule();
+    return 0;
+}
+
+static void pthread_run_destructors(struct pthread *self)
+{
+    int i, k, called;
+
+    for (i = 0; i < PTHREAD_DESTRUCTOR_ITERATIONS; i++) {
+        called = 0;
+        for (k = 0; k < PTHREAD_KEYS_MAX; k++) {
+            void *value = (void *) self->specific[k].value;
+
+            if (!value || !pthread_keys[k].in_use ||
+                !pthread_keys[k].destructor ||
+                self->specific[k].seq != pthread_keys[k].seq)
+                continue;
+            self->specific[k].value = NULL;
+            pthread_keys[k].destructor(value);
+            called = 1;
+        }
+        if (!called)
+            break;
+    }
+}
+
+static void pthread_release(struct pthread *self, void *retval)
+{
+    unsigned long flags;
+    int detached;
+
+    pthread_run_destructors(self);
+
+    local_irq_save(flags);
+    self->thread->pthread = NULL;
+    self->retval = retval;
+    self->exited = 1;
+    detached = self->detached;
+    /* Once IRQs are back on, a joiner may free it */
+    if (!detached)
+        wake_up(&self->join_wait);
+    local_irq_restore(flags);
+    if (detached)
+        free(self);
+}
+
+void pthread_exit(void *retval)
+{
+    struct pthread *self = get_current()->pthread;
+
+    if (self)
+        pthread_release(self, retval);
+    exit_thread();
+}
+
+/* The thread left through exit_thread() directly */
+void pthread_thread_exit(struct thread *thread)
+{
+    pthread_release(thread->pthread, NULL);
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    if (thread->thread == get_current())
+        return EDEADLK;
+    if (thread->detached)
+        return EINVAL;
+    wait_event(thread->join_wait, thread->exited);
+    if (retval)
+        *retval = thread->retval;
+    free(thread);
+    return 0;
+}
+
+int pthread_detach(pthread_t thread)
+{
+    unsigned long flags;
+    int exited;
+
+    local_irq_save(flags);
+    if (thread->detached) {
+        local_irq_restore(flags);
+        return EINVAL;
+    }
+    thread->detached = 1;
+    exited = thread->exited;
+    local_irq_restore(flags);
+    if (exited)
+        free(thread);
+    return 0;
+}
+
+int pthread_key_create(pthread_key_t *key, void (*destr_function)(void *))
+{
+    unsigned long flags;
+    int k;
+
+    local_irq_save(flags);
+    for (k = 0; k < PTHREAD_KEYS_MAX; k++)
+        if (!pthread_keys[k].in_use)
+            break;
+    if (k == PTHREAD_KEYS_MAX) {
+        local_irq_restore(flags);
+        return EAGAIN;
+    }
+    pthread_keys[k].in_use = 1;
+    pthread_keys[k].seq++;
+    pthread_keys[k].destructor = destr_function;
+    local_irq_restore(flags);
+    *key = k;
+    return 0;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+    if (key >= PTHREAD_KEYS_MAX || !pthread_keys[key].in_use)
+        return EINVAL;
+    pthread_keys[key].in_use = 0;
+    return 0;
+}
+
+int pthread_setspecific(pthread_key_t key, const void *pointer)
+{
+    struct pthread *self;
+
+    if (key >= PTHREAD_KEYS_MAX || !pthread_keys[key].in_use)
+        return EINVAL;
+    self = pthread_self();
+    if (!self)
+        return ENOMEM;
+    self->specific[key].seq = pthread_keys[key].seq;
+    self->specific[key].value = pointer;
+    return 0;
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+    /* No value was set if it has none */
+    struct pthread *self = get_current()->pthread;
+
+    if (!self || key >= PTHREAD_KEYS_MAX || !pthread_keys[key].in_use ||
+        self->specific[key].seq != pthread_keys[key].seq)
+        return NULL;
+    return (void *) self->specific[key].value;
+}
+
+int pthread_mutexattr_init(pthread_mutexattr_t *mattr)
+{
+    mattr->type = PTHREAD_MUTEX_DEFAULT;
+    return 0;
+}
+
+int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind)
+{
+    if (kind != PTHREAD_MUTEX_NORMAL && kind != PTHREAD_MUTEX_RECURSIVE &&
+        kind != PTHREAD_MUTEX_ERRORCHECK)
+        return EINVAL;
+    mattr->type = kind;
+    return 0;
+}
+
+int pthread_mutexattr_gettype(const pthread_mutexattr_t *mattr, int *kind)
+{
+    *kind = mattr->type;
+    return 0;
+}
+
+int pthread_mutexattr_destroy(pthread_mutexattr_t *mattr)
+{
+    return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *mattr)
+{
+    mutex->type = mattr ? mattr->type : PTHREAD_MUTEX_DEFAULT;
+    mutex->owner = NULL;
+    mutex->count = 0;
+    init_waitqueue_head(&mutex->wait);
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    return mutex->owner ? EBUSY : 0;
+}
+
+/* Relocking a normal mutex fails too rather than deadlocking */
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    struct thread *self = get_current();
+    unsigned long flags;
+    DEFINE_WAIT(w);
+
+    local_irq_save(flags);
+    if (mutex->owner == self) {
+        if (mutex->type != PTHREAD_MUTEX_RECURSIVE) {
+            local_irq_restore(flags);
+            return EDEADLK;
+        }
+        mutex->count++;
+        local_irq_restore(flags);
+        return 0;
+    }
+    while (mutex->owner) {
+        pthread_waitq_init(&mutex->wait);
+        add_wait_queue_exclusive(&mutex->wait, &w);
+        block(self);
+        local_irq_restore(flags);
+        schedule();
+        local_irq_save(flags);
+    }
+    remove_wait_queue(&mutex->wait, &w);
+    mutex->owner = self;
+    mutex->count = 1;
+    local_irq_restore(flags);
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    struct thread *self = get_current();
+    unsigned long flags;
+    int ret = 0;
+
+    local_irq_save(flags);
+    if (!mutex->owner) {
+        mutex->owner = self;
+        mutex->count = 1;
+    } else if (mutex->owner == self && mutex->type == PTHREAD_MUTEX_RECURSIVE)
+        mutex->count++;
+    else
+        ret = EBUSY;
+    local_irq_restore(flags);
+    return ret;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (mutex->owner != get_current()) {
+        local_irq_restore(flags);
+        return EPERM;
+    }
+    if (!--mutex->count) {
+        mutex->owner = NULL;
+        wake_up_one(&mutex->wait);
+    }
+    local_irq_restore(flags);
+    return 0;
+}
+
+int pthread_condattr_init(pthread_condattr_t *attr)
+{
+    attr->clock = CLOCK_REALTIME;
+    return 0;
+}
+
+int pthread_condattr_destroy(pthread_condattr_t *attr)
+{
+    return 0;
+}
+
+int pthread_condattr_setclock(pthread_condattr_t *attr, clockid_t clock)
+{
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)
+        return EINVAL;
+    attr->clock = clock;
+    return 0;
+}
+
+int pthread_condattr_getclock(const pthread_condattr_t *attr, clockid_t *clock)
+{
+    *clock = attr->clock;
+    return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    cond->clock = attr ? attr->clock : CLOCK_REALTIME;
+    init_waitqueue_head(&cond->wait);
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    return MINIOS_STAILQ_EMPTY(&cond->wait) ? 0 : EBUSY;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    wake_up_one(&cond->wait);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    wake_up_nr(&cond->wait, INT_MAX);
+    return 0;
+}
+
+/* Like wait_event_deadline, but the mutex is released once queued */
+static int pthread_cond_wait_deadline(pthread_cond_t *cond,
+                                      pthread_mutex_t *mutex,
+                                      s_time_t deadline)
+{
+    struct thread *self = get_current();
+    unsigned long flags;
+    int count, ret = 0;
+    DEFINE_WAIT(w);
+
+    local_irq_save(flags);
+    if (mutex->owner != self) {
+        local_irq_restore(flags);
+        return EPERM;
+    }
+    pthread_waitq_init(&cond->wait);
+    add_wait_queue_exclusive(&cond->wait, &w);
+    count = mutex->count;
+    mutex->owner = NULL;
+    mutex->count = 0;
+    wake_up_one(&mutex->wait);
+    block(self);
+    self->wakeup_time = deadline;
+    local_irq_restore(flags);
+    schedule();
+
+    local_irq_save(flags);
+    /* Signalled waiters were taken off the queue */
+    if (w.waiting) {
+        remove_wait_queue(&cond->wait, &w);
+        if (deadline && NOW() >= deadline)
+            ret = ETIMEDOUT;
+    }
+    local_irq_restore(flags);
+
+    pthread_mutex_lock(mutex);
+    mutex->count = count;
+    return ret;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    return pthread_cond_wait_deadline(cond, mutex, 0);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime)
+{
+    struct timespec now;
+    s_time_t timeout;
+
+    if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+        return EINVAL;
+    clock_gettime(cond->clock, &now);
+    timeout = SECONDS((s_time_t) (abstime->tv_sec - now.tv_sec)) +
+              (abstime->tv_nsec - now.tv_nsec);
+    if (timeout <= 0)
+        return ETIMEDOUT;
+    return pthread_cond_wait_deadline(cond, mutex, NOW() + timeout);
+}
+
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (!once_control->state) {
+        once_control->state = 1;
+        local_irq_restore(flags);
+        init_routine();
+        local_irq_save(flags);
+        once_control->state = 2;
+        wake_up(&pthread_once_wait);
+    }
+    local_irq_restore(flags);
+    wait_event(pthread_once_wait, once_control->state == 2);
+    return 0;
+}
+#endif
@@ -29,6 +29,7 @@
 #include <fbfront.h>
 #include <xenbus.h>
 #include <xs.h>
+#include <mini-os/err.h>
 
 #include <sys/types.h>
 #include <sys/unistd.h>
@@ -258,7 +259,11 @@ int read(int fd, void *buf, size_t nbytes)
 	case FTYPE_TAP: {
 	    ssize_t ret;
 	    ret = netfront_receive(files[fd].tap.dev, buf, nbytes);
-	    if (ret <= 0) {
+	    if (ret < 0) {
+		errno = -ret;
+		return -1;
+	    }
+	    if (ret == 0) {
 		errno = EAGAIN;
 		return -1;
 	    }
@@ -288,6 +293,18 @@ int read(int fd, void *buf, size_t nbytes)
 	    }
 	    return ret * sizeof(union xenfb_in_event);
         }
+#endif
+#ifdef CONFIG_BLKFRONT
+	case FTYPE_BLK: {
+	    ssize_t ret;
+	    ret = blkfront_pread(files[fd].blk.dev, buf, nbytes, files[fd].blk.offset);
+	    if (ret < 0) {
+		errno = -ret;
+		return -1;
+	    }
+	    files[fd].blk.offset += ret;
+	    return ret;
+	}
 #endif
 	default:
 	    break;
@@ -320,6 +337,18 @@ int write(int fd, const void *buf, size_t nbytes)
 	case FTYPE_TAP:
 	    netfront_xmit(files[fd].tap.dev, (void*) buf, nbytes);
 	    return nbytes;
+#endif
+#ifdef CONFIG_BLKFRONT
+	case FTYPE_BLK: {
+	    ssize_t ret;
+	    ret = blkfront_pwrite(files[fd].blk.dev, buf, nbytes, files[fd].blk.offset);
+	    if (ret < 0) {
+		errno = -ret;
+		return -1;
+	    }
+	    files[fd].blk.offset += ret;
+	    return ret;
+	}
 #endif
 	default:
 	    break;
@@ -329,13 +358,107 @@ int write(int fd, const void *buf, size_t nbytes)
     return -1;
 }
 
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    switch (files[fd].type) {
+#ifdef CONFIG_BLKFRONT
+	case FTYPE_BLK: {
+	    ssize_t ret;
+	    ret = blkfront_pread(files[fd].blk.dev, buf, nbytes, offset);
+	    if (ret < 0) {
+		errno = -ret;
+		return -1;
+	    }
+	    return ret;
+	}
+#endif
+	case FTYPE_NONE:
+	    errno = EBADF;
+	    return -1;
+	default:
+	    break;
+    }
+    errno = ESPIPE;
+    return -1;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    switch (files[fd].type) {
+#ifdef CONFIG_BLKFRONT
+	case FTYPE_BLK: {
+	    ssize_t ret;
+	    ret = blkfront_pwrite(files[fd].blk.dev, buf, nbytes, offset);
+	    if (ret < 0) {
+		errno = -ret;
+		return -1;
+	    }
+	    return ret;
+	}
+#endif
+	case FTYPE_NONE:
+	    errno = EBADF;
+	    return -1;
+	default:
+	    break;
+    }
+    errno = ESPIPE;
+    return -1;
+}
+
 off_t lseek(int fd, off_t offset, int whence)
 {
+    switch (files[fd].type) {
+#ifdef CONFIG_BLKFRONT
+	case FTYPE_BLK: {
+	    struct blkfront_info info;
+	    off_t base;
+
+	    switch (whence) {
+		case SEEK_SET:
+		    base = 0;
+		    break;
+		case SEEK_CUR:
+		    base = files[fd].blk.offset;
+		    break;
+		case SEEK_END:
+		    blkfront_get_info(files[fd].blk.dev, &info);
+		    base = info.sectors * info.sector_size;
+		    break;
+		default:
+		    errno = EINVAL;
+		    return (off_t) -1;
+	    }
+	    if (base + offset < 0) {
+		errno = EINVAL;
+		return (off_t) -1;
+	    }
+	    files[fd].blk.offset = base + offset;
+	    return files[fd].blk.offset;
+	}
+#endif
+	default:
+	    break;
+    }
     errno = ESPIPE;
     return (off_t) -1;
 }
 
 int fsync(int fd) {
+    switch (files[fd].type) {
+#ifdef CONFIG_BLKFRONT
+	case FTYPE_BLK: {
+	    int ret = blkfront_sync(files[fd].blk.dev);
+	    if (ret) {
+		errno = -ret;
+		return -1;
+	    }
+	    return 0;
+	}
+#endif
+	default:
+	    break;
+    }
     errno = EBADF;
     return -1;
 }
@@ -445,6 +568,25 @@ int fstat(int fd, struct stat *buf)
 	    buf->st_ctime = time(NULL);
 	    return 0;
 	}
+#ifdef CONFIG_BLKFRONT
+	case FTYPE_BLK: {
+	    struct blkfront_info info;
+
+	    blkfront_get_info(files[fd].blk.dev, &info);
+	    buf->st_mode = S_IFBLK|S_IRUSR;
+	    if (info.mode == O_RDWR)
+		buf->st_mode |= S_IWUSR;
+	    buf->st_uid = 0;
+	    buf->st_gid = 0;
+	    buf->st_size = info.sectors * info.sector_size;
+	    buf->st_blksize = info.physical_sector_size;
+	    buf->st_blocks = buf->st_size / 512;
+	    buf->st_atime =
+	    buf->st_mtime =
+	    buf->st_ctime = time(NULL);
+	    return 0;
+	}
+#endif
 	default:
 	    break;
     }
@@ -1147,6 +1289,19 @@ void *mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset
     unsigned long n = (length + PAGE_SIZE - 1) / PAGE_SIZE;
 
     ASSERT(!start);
+#if defined(CONFIG_BLKFRONT) && !defined(__ia64__)
+    if (fd != -1 && files[fd].type == FTYPE_BLK) {
+        void *ret;
+
+        ASSERT(flags == MAP_SHARED);
+        ret = blkfront_mmap(files[fd].blk.dev, length, offset, prot & PROT_WRITE);
+        if (IS_ERR(ret)) {
+            errno = -PTR_ERR(ret);
+            return MAP_FAILED;
+        }
+        return ret;
+    }
+#endif
     ASSERT(prot == (PROT_READ|PROT_WRITE));
     ASSERT((fd == -1 && (flags == (MAP_SHARED|MAP_ANON) || flags == (MAP_PRIVATE|MAP_ANON)))
         || (fd != -1 && flags == MAP_SHARED));
@@ -1167,6 +1322,16 @@ int munmap(void *start, size_t length)
     int total = length / PAGE_SIZE;
     int ret;
 
+#if defined(CONFIG_BLKFRONT) && !defined(__ia64__)
+    ret = blkfront_munmap(start, length);
+    if (ret != -ENOENT) {
+        if (ret) {
+            errno = -ret;
+            return -1;
+        }
+        return 0;
+    }
+#endif
     ret = unmap_frames((unsigned long)start, (unsigned long)total);
     if (ret) {
         errno = ret;
@@ -1175,6 +1340,23 @@ int munmap(void *start, size_t length)
     return 0;
 }
 
+int msync(void *addr, size_t length, int flags)
+{
+#if defined(CONFIG_BLKFRONT) && !defined(__ia64__)
+    int ret = blkfront_msync(addr, length, flags & MS_SYNC);
+
+    if (ret != -ENOENT) {
+        if (ret) {
+            errno = -ret;
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    /* Other mappings have no backing store */
+    return 0;
+}
+
 void sparse(unsigned long data, size_t size)
 {
     unsigned long newdata;
@@ -135,7 +135,7 @@ static void *xmalloc_whole_pages(size_t size, size_t align)
     return ret;
 }
 
-void *_xmalloc(size_t size, size_t align)
+static void *__xmalloc(size_t size, size_t align)
 {
     struct xmalloc_hdr *i, *tmp, *hdr = NULL;
     uintptr_t data_begin;
@@ -196,9 +196,21 @@ void *_xmalloc(size_t size, size_t align)
     return (void*)data_begin;
 }
 
-void xfree(const void *p)
+/* The free list is protected by disabling events, so that threads may be
+ * preempted in the middle of an allocation */
+void *_xmalloc(size_t size, size_t align)
+{
+    unsigned long flags;
+    void *p;
+
+    local_irq_save(flags);
+    p = __xmalloc(size, align);
+    local_irq_restore(flags);
+    return p;
+}
+
+static void __xfree(const void *p)
 {
-    /* unsigned long flags; */
     struct xmalloc_hdr *i, *tmp, *hdr;
     struct xmalloc_pad *pad;
 
@@ -267,12 +279,22 @@ void xfree(const void *p)
     /* spin_unlock_irqrestore(&freelist_lock, flags); */
 }
 
+void xfree(const void *p)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    __xfree(p);
+    local_irq_restore(flags);
+}
+
 void *_realloc(void *ptr, size_t size)
 {
     void *new;
     struct xmalloc_hdr *hdr;
     struct xmalloc_pad *pad;
     size_t old_data_size;
+    unsigned long flags;
 
     if (ptr == NULL)
         return _xmalloc(size, DEFAULT_ALIGN);
@@ -283,7 +305,9 @@ void *_realloc(void *ptr, size_t size)
     old_data_size = hdr->size - pad->hdr_size;
     if ( old_data_size >= size )
     {
+        local_irq_save(flags);
 	maybe_split(hdr, pad->hdr_size + size, hdr->size);
+        local_irq_restore(flags);
         return ptr;
     }
     
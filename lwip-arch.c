@@ -240,6 +240,8 @@ sys_thread_t sys_thread_new(char *name, void (* thread)(void *arg), void *arg, i
 	do_exit();
     }
     lwip_thread = t = create_thread(name, thread, arg);
+    /* This is the tcpip thread, which gets the packets netfront receives */
+    set_thread_priority(t, THREAD_PRIO_HIGH);
     return t;
 }
 
@@ -41,6 +41,9 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/xmalloc.h>
+#ifdef HAVE_LIBC
+#include <sys/reent.h>
+#endif
 
 #ifdef MM_DEBUG
 #define DEBUG(_f, _a...) \
@@ -260,7 +263,9 @@ unsigned long alloc_pages(int order)
     int i;
     chunk_head_t *alloc_ch, *spare_ch;
     chunk_tail_t            *spare_ct;
+    unsigned long flags;
 
+    local_irq_save(flags);
 
     /* Find smallest order which can satisfy the request. */
     for ( i = order; i < FREELIST_SIZE; i++ ) {
@@ -295,10 +300,12 @@ unsigned long alloc_pages(int order)
     }
     
     map_alloc(PHYS_PFN(to_phys(alloc_ch)), 1UL<<order);
+    local_irq_restore(flags);
 
     return((unsigned long)alloc_ch);
 
  no_memory:
+    local_irq_restore(flags);
 
     printk("Cannot handle page request order %d!\n", order);
 
@@ -310,7 +317,9 @@ void free_pages(void *pointer, int order)
     chunk_head_t *freed_ch, *to_merge_ch;
     chunk_tail_t *freed_ct;
     unsigned long mask;
+    unsigned long flags;
     
+    local_irq_save(flags);
     /* First free the chunk */
     map_free(virt_to_pfn(pointer), 1UL << order);
     
@@ -357,7 +366,8 @@ void free_pages(void *pointer, int order)
     freed_ct->level = order;
     
     freed_ch->next->pprev = &freed_ch->next;
-    free_head[order] = freed_ch;   
+    free_head[order] = freed_ch;
+    local_irq_restore(flags);
    
 }
 
@@ -395,6 +405,26 @@ void *sbrk(ptrdiff_t increment)
 
     return (void *) old_brk;
 }
+
+/* Newlib's malloc state is shared by all threads: keep them, and event
+ * handlers, out of it while one is in it.  The lock nests.  */
+static int malloc_lock_depth;
+static unsigned long malloc_lock_flags;
+
+void __malloc_lock(struct _reent *reent)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (!malloc_lock_depth++)
+        malloc_lock_flags = flags;
+}
+
+void __malloc_unlock(struct _reent *reent)
+{
+    if (!--malloc_lock_depth)
+        local_irq_restore(malloc_lock_flags);
+}
 #endif
 
 
@@ -16,6 +16,9 @@
 #include <mini-os/netfront.h>
 #include <mini-os/lib.h>
 #include <mini-os/semaphore.h>
+#ifdef CONFIG_BLKFRONT
+#include <mini-os/blkfront.h>
+#endif
 
 DECLARE_WAIT_QUEUE_HEAD(netfront_queue);
 
@@ -618,14 +621,17 @@ void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
     if (!page)
 	page = buf->page = (char*) alloc_page();
 
-    i = dev->tx.req_prod_pvt;
-    tx = RING_GET_REQUEST(&dev->tx, i);
-
     memcpy(page,data,len);
 
-    buf->gref = 
-        tx->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
+    /* Granting may sleep, so before taking the slot */
+    buf->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
+
+    /* Not to be preempted by another sender until the slot is pushed */
+    local_irq_save(flags);
+    i = dev->tx.req_prod_pvt;
+    tx = RING_GET_REQUEST(&dev->tx, i);
 
+    tx->gref = buf->gref;
     tx->offset=0;
     tx->size = len;
     tx->flags=0;
@@ -638,7 +644,6 @@ void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
 
     if(notify) notify_remote_via_evtchn(dev->evtchn);
 
-    local_irq_save(flags);
     network_tx_buf_gc(dev);
     local_irq_restore(flags);
 }
@@ -650,6 +655,12 @@ ssize_t netfront_receive(struct netfront_dev *dev, unsigned char *data, size_t l
     int fd = dev->fd;
     ASSERT(current == main_thread);
 
+#ifdef CONFIG_BLKFRONT
+    /* Packets are copied with events disabled, faults can't be served then */
+    if (blkfront_map_pin(data, len, 1) < 0)
+        return -EFAULT;
+#endif
+
     dev->rlen = 0;
     dev->data = data;
     dev->len = len;
@@ -665,6 +676,9 @@ ssize_t netfront_receive(struct netfront_dev *dev, unsigned char *data, size_t l
 
     dev->data = NULL;
     dev->len = 0;
+#ifdef CONFIG_BLKFRONT
+    blkfront_map_unpin(data, len);
+#endif
 
     return dev->rlen;
 }
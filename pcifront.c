@@ -14,6 +14,7 @@
 #include <mini-os/wait.h>
 #include <mini-os/pcifront.h>
 #include <mini-os/sched.h>
+#include <mini-os/semaphore.h>
 
 #define PCI_DEVFN(slot, func) ((((slot) & 0x1f) << 3) | ((func) & 0x07))
 
@@ -31,6 +32,8 @@ struct pcifront_dev {
     char *backend;
 
     xenbus_event_queue events;
+    /* There is a single op slot in info */
+    struct semaphore op_sem;
 };
 
 void pcifront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
@@ -165,6 +168,7 @@ struct pcifront_dev *init_pcifront(char *_nodename)
 
     dev = malloc(sizeof(*dev));
     memset(dev, 0, sizeof(*dev));
+    init_MUTEX(&dev->op_sem);
     dev->nodename = strdup(nodename);
     dev->dom = dom;
 
@@ -430,6 +434,7 @@ void pcifront_op(struct pcifront_dev *dev, struct xen_pci_op *op)
 {
     if (!dev)
         dev = pcidev;
+    down(&dev->op_sem);
     dev->info->op = *op;
     /* Make sure info is written before the flag */
     wmb();
@@ -441,6 +446,7 @@ void pcifront_op(struct pcifront_dev *dev, struct xen_pci_op *op)
     /* Make sure flag is read before info */
     rmb();
     *op = dev->info->op;
+    up(&dev->op_sem);
 }
 
 int pcifront_conf_read(struct pcifront_dev *dev,
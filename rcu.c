@@ -0,0 +1,80 @@
+/*
+ * RCU callbacks are queued until the next quiescent state, that is the
+ * next call to schedule().  With several CPUs, a grace period would have to
+ * wait for each of them to go through one.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/wait.h>
+#include <mini-os/rcu.h>
+
+static struct rcu_head *rcu_list;
+static struct rcu_head **rcu_tail = &rcu_list;
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    unsigned long flags;
+
+    head->next = NULL;
+    head->func = func;
+    local_irq_save(flags);
+    *rcu_tail = head;
+    rcu_tail = &head->next;
+    local_irq_restore(flags);
+}
+
+void rcu_quiescent_state(void)
+{
+    struct rcu_head *head, *next;
+    unsigned long flags;
+
+    if (!rcu_list)
+        return;
+    local_irq_save(flags);
+    head = rcu_list;
+    rcu_list = NULL;
+    rcu_tail = &rcu_list;
+    local_irq_restore(flags);
+
+    for (; head; head = next) {
+        next = head->next;
+        head->func(head);
+    }
+}
+
+struct rcu_sync
+{
+    /* First, for rcu_sync_done() */
+    struct rcu_head head;
+    int done;
+    struct wait_queue_head wait;
+};
+
+static void rcu_sync_done(struct rcu_head *head)
+{
+    struct rcu_sync *sync = (struct rcu_sync *)head;
+
+    sync->done = 1;
+    wake_up(&sync->wait);
+}
+
+void synchronize_rcu(void)
+{
+    struct rcu_sync sync;
+
+    sync.done = 0;
+    init_waitqueue_head(&sync.wait);
+    call_rcu(&sync.head, rcu_sync_done);
+    wait_event(sync.wait, sync.done);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -12,8 +12,16 @@
  * Environment: Xen Minimal OS
  * Description: simple scheduler for Mini-Os
  *
- * The scheduler is non-preemptive (cooperative), and schedules according 
- * to Round Robin algorithm.
+ * The scheduler is non-preemptive (cooperative) unless built with
+ * CONFIG_PREEMPT, and schedules according to Round Robin algorithm within
+ * each priority.  Runnable threads wait in a
+ * FIFO run queue per priority, and threads sleeping until a deadline on a
+ * timer.  A runnable thread always runs before threads of lower priority.
+ *
+ * With CONFIG_PREEMPT, a thread is preempted on return from an event upcall
+ * once it has run for its time slice, or when a thread of higher priority
+ * was woken, unless it had events disabled.  Code that must not be
+ * preempted uses local_irq_save, as it does against event handlers.
  *
  ****************************************************************************
  * Permission is hereby granted, free of charge, to any person obtaining a copy
@@ -45,6 +53,8 @@
 #include <mini-os/list.h>
 #include <mini-os/sched.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/errno.h>
+#include <mini-os/rcu.h>
 
 
 #ifdef SCHED_DEBUG
@@ -61,24 +71,269 @@ static struct thread_list exited_threads = MINIOS_TAILQ_HEAD_INITIALIZER(exited_
 static struct thread_list thread_list = MINIOS_TAILQ_HEAD_INITIALIZER(thread_list);
 static int threads_started;
 
+/* Threads made runnable, in order, per priority.  Threads are only taken off
+ * them when picked, so they may also hold threads that blocked again
+ * meanwhile.  */
+static struct thread_list run_queue[NR_THREAD_PRIO] = {
+    MINIOS_TAILQ_HEAD_INITIALIZER(run_queue[THREAD_PRIO_HIGH]),
+    MINIOS_TAILQ_HEAD_INITIALIZER(run_queue[THREAD_PRIO_NORMAL]),
+    MINIOS_TAILQ_HEAD_INITIALIZER(run_queue[THREAD_PRIO_LOW]),
+};
+
 struct thread *main_thread;
 
+/* Time spent with no runnable thread */
+static s_time_t idle_time;
+
+/* Stacks of exited threads, reused before allocating new ones */
+#define STACK_CACHE_SIZE 8
+static struct {
+    char *stack;
+    unsigned long size;
+} stack_cache[STACK_CACHE_SIZE];
+static int stack_cache_nr;
+
+#ifdef CONFIG_PREEMPT
+/* Time a thread may run before being preempted, 0 disables preemption */
+static s_time_t sched_slice = MILLISECS(10);
+static s_time_t slice_end;
+/* Preempt the running thread on return from the event upcall */
+static int need_resched;
+/* Nesting of preempt_disable() */
+int preempt_count;
+#endif
+
 void inline print_runqueue(void)
 {
     struct thread *th;
     MINIOS_TAILQ_FOREACH(th, &thread_list, thread_list)
     {
-        printk("   Thread \"%s\", runnable=%d\n", th->name, is_runnable(th));
+        printk("   Thread \"%s\", runnable=%d, prio=%d\n", th->name,
+               is_runnable(th), th->prio);
     }
     printk("\n");
 }
 
+#define STATS_MAX_THREADS 32
+
+/* Deepest the thread has used its stack, from what is left of the fill */
+#define STACK_FILL_WORD (~0UL / 0xff * STACK_FILL)
+
+unsigned long thread_stack_used(struct thread *thread)
+{
+    unsigned long *p = (unsigned long *)thread->stack_limit;
+    unsigned long *top = (unsigned long *)(thread->stack + STACK_SIZE);
+
+    if (!p)
+        return 0;
+    while (p < top && *p == STACK_FILL_WORD)
+        p++;
+    return (char *)top - (char *)p;
+}
+
+/* Part of the stack, at its bottom, which must keep its fill */
+#define STACK_CHECK_SHIFT 4
+
+/*
+ * Called when the thread is switched out.  An overflow into the guard pages
+ * crashes the domain before anything can be printed: the fault is delivered
+ * on the overflowed stack.  So report threads which used the last 1/16 of
+ * their stack instead, once.
+ */
+static void check_stack(struct thread *thread)
+{
+    unsigned long *limit = (unsigned long *)thread->stack_limit;
+    unsigned long i, n;
+
+    if (!limit || (thread->flags & STACK_WARNED_FLAG))
+        return;
+    n = ((thread->stack + STACK_SIZE - thread->stack_limit) >> STACK_CHECK_SHIFT) /
+        sizeof(*limit);
+    for (i = 0; i < n; i++)
+        if (limit[i] != STACK_FILL_WORD) {
+            thread->flags |= STACK_WARNED_FLAG;
+            printk("Thread \"%s\" almost overflowed its stack: %lu bytes, %lu used\n",
+                   thread->name,
+                   (unsigned long)(thread->stack + STACK_SIZE - thread->stack_limit),
+                   thread_stack_used(thread));
+            return;
+        }
+}
+
+static s_time_t thread_run_time(struct thread *thread, s_time_t now)
+{
+    if (thread == get_current())
+        return thread->stats.run_time + now - thread->stamp;
+    return thread->stats.run_time;
+}
+
+/* Print the scheduling statistics of the threads using the most CPU */
+void print_thread_stats(void)
+{
+    static struct thread *top[STATS_MAX_THREADS];
+    struct thread *th;
+    s_time_t now, run;
+    unsigned long flags;
+    int i, n = 0, nr = 0;
+
+    local_irq_save(flags);
+    now = NOW();
+    MINIOS_TAILQ_FOREACH(th, &thread_list, thread_list) {
+        nr++;
+        run = thread_run_time(th, now);
+        for (i = n; i > 0 && thread_run_time(top[i - 1], now) < run; i--)
+            if (i < STATS_MAX_THREADS)
+                top[i] = top[i - 1];
+        if (i < STATS_MAX_THREADS)
+            top[i] = th;
+        if (n < STATS_MAX_THREADS)
+            n++;
+    }
+
+    printk("%d threads, up %llu ms, idle %llu ms\n", nr,
+           (unsigned long long) (now / 1000000),
+           (unsigned long long) (idle_time / 1000000));
+    printk(" %%CPU   RUN ms  WAIT ms  MAXWAIT us  BLOCK ms  VOLUNTARY  FORCED  WAKEUPS  STACK KB  S P NAME\n");
+    for (i = 0; i < n; i++) {
+        struct thread_stats *st = &top[i]->stats;
+        s_time_t block = st->block_time;
+        unsigned pct;
+
+        th = top[i];
+        run = thread_run_time(th, now);
+        if (th != get_current() && !is_runnable(th))
+            block += now - th->stamp;
+        pct = now ? run * 1000 / now : 0;
+        printk("%3u.%u %8llu %8llu %11llu %9llu %10lu %7lu %8lu %4lu/%-4lu  %c %d %s\n",
+               pct / 10, pct % 10,
+               (unsigned long long) (run / 1000000),
+               (unsigned long long) (st->wait_time / 1000000),
+               (unsigned long long) (st->wait_max / 1000),
+               (unsigned long long) (block / 1000000),
+               st->voluntary, st->forced, st->wakeups,
+               thread_stack_used(th) >> 10, th->stack_size >> 10,
+               th == get_current() ? 'R' : is_runnable(th) ? 'r' : 'B',
+               th->prio, th->name);
+    }
+    local_irq_restore(flags);
+}
+
+/* All of these are called with IRQs disabled */
+static void runq_add(struct thread *thread)
+{
+    if (thread->flags & RUNQ_FLAG)
+        return;
+    thread->flags |= RUNQ_FLAG;
+    MINIOS_TAILQ_INSERT_TAIL(&run_queue[thread->prio], thread, run_list);
+}
+
+static void runq_remove(struct thread *thread)
+{
+    if (!(thread->flags & RUNQ_FLAG))
+        return;
+    thread->flags &= ~RUNQ_FLAG;
+    MINIOS_TAILQ_REMOVE(&run_queue[thread->prio], thread, run_list);
+}
+
+static struct thread *runq_pop(void)
+{
+    struct thread *thread;
+    int prio;
+
+    for (prio = 0; prio < NR_THREAD_PRIO; prio++)
+        while ((thread = MINIOS_TAILQ_FIRST(&run_queue[prio]))) {
+            runq_remove(thread);
+            if (is_runnable(thread))
+                return thread;
+        }
+    return NULL;
+}
+
+/* Free the cached stacks, to give their memory back */
+static void drain_stack_cache(void)
+{
+    char *stacks[STACK_CACHE_SIZE];
+    unsigned long sizes[STACK_CACHE_SIZE];
+    unsigned long flags;
+    int i, n;
+
+    local_irq_save(flags);
+    n = stack_cache_nr;
+    for (i = 0; i < n; i++) {
+        stacks[i] = stack_cache[i].stack;
+        sizes[i] = stack_cache[i].size;
+    }
+    stack_cache_nr = 0;
+    local_irq_restore(flags);
+    /* Unmapping takes hypercalls, keep events enabled */
+    for (i = 0; i < n; i++)
+        arch_free_stack(stacks[i], sizes[i]);
+}
+
+static char *get_stack(unsigned long size)
+{
+    char *stack = NULL;
+    unsigned long flags;
+    int i;
+
+    local_irq_save(flags);
+    for (i = stack_cache_nr - 1; i >= 0; i--)
+        if (stack_cache[i].size == size) {
+            stack = stack_cache[i].stack;
+            stack_cache[i] = stack_cache[--stack_cache_nr];
+            break;
+        }
+    local_irq_restore(flags);
+    if (!stack) {
+        stack = arch_alloc_stack(size);
+        /* Cached stacks of other sizes may hold the memory needed */
+        if (!stack && stack_cache_nr) {
+            drain_stack_cache();
+            stack = arch_alloc_stack(size);
+        }
+    }
+    return stack;
+}
+
+static void put_stack(char *stack, unsigned long size)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (stack_cache_nr < STACK_CACHE_SIZE) {
+        stack_cache[stack_cache_nr].stack = stack;
+        stack_cache[stack_cache_nr].size = size;
+        stack_cache_nr++;
+        stack = NULL;
+    }
+    local_irq_restore(flags);
+    if (stack)
+        arch_free_stack(stack, size);
+}
+
+/* Charge the time since the thread's last state change as run time */
+static void account_run(struct thread *thread, s_time_t now)
+{
+    thread->stats.run_time += now - thread->stamp;
+    thread->stamp = now;
+}
+
+/* Timer function of threads sleeping until their wakeup_time */
+static void thread_timeout(void *data)
+{
+    wake(data);
+}
+
 void schedule(void)
 {
     struct thread *prev, *next, *thread, *tmp;
+    struct thread_list freed = MINIOS_TAILQ_HEAD_INITIALIZER(freed);
     unsigned long flags;
 
     prev = current;
+    /* Not within an RCU read-side section, callbacks queued until now may
+     * run. */
+    rcu_quiescent_state();
     local_irq_save(flags); 
 
     if (in_callback) {
@@ -90,73 +345,192 @@ void schedule(void)
         BUG();
     }
 
+    /* The thread may have set its wakeup_time after blocking */
+    if (!is_runnable(prev) && prev->wakeup_time != 0LL)
+        timer_mod(&prev->timer, prev->wakeup_time);
+
     do {
-        /* Examine all threads.
-           Find a runnable thread, but also wake up expired ones and find the
-           time when the next timeout expires, else use 10 seconds. */
-        s_time_t now = NOW();
-        s_time_t min_wakeup_time = now + SECONDS(10);
-        next = NULL;
-        MINIOS_TAILQ_FOREACH_SAFE(thread, &thread_list, thread_list, tmp)
-        {
-            if (!is_runnable(thread) && thread->wakeup_time != 0LL)
-            {
-                if (thread->wakeup_time <= now)
-                    wake(thread);
-                else if (thread->wakeup_time < min_wakeup_time)
-                    min_wakeup_time = thread->wakeup_time;
-            }
-            if(is_runnable(thread)) 
-            {
-                next = thread;
-                /* Put this thread on the end of the list */
-                MINIOS_TAILQ_REMOVE(&thread_list, thread, thread_list);
-                MINIOS_TAILQ_INSERT_TAIL(&thread_list, thread, thread_list);
-                break;
-            }
-        }
+        s_time_t now = NOW(), idle;
+
+        timer_run(now);
+
+        /* wake() does not queue the running thread, it goes at the end */
+        if (is_runnable(prev))
+            runq_add(prev);
+        next = runq_pop();
         if (next)
             break;
-        /* block until the next timeout expires, or for 10 secs, whichever comes first */
-        block_domain(min_wakeup_time);
+        /* Block until the next timer expires, or until an event if there
+           is none */
+        account_run(prev, now);
+        block_domain(timer_next());
+        /* prev was blocked too */
+        idle = NOW() - now;
+        idle_time += idle;
+        prev->stats.block_time += idle;
+        prev->stamp += idle;
         /* handle pending events if any */
         force_evtchn_callback();
     } while(1);
+    if (prev != next) {
+        s_time_t now = NOW(), wait;
+
+        check_stack(prev);
+
+        account_run(prev, now);
+        if (is_runnable(prev))
+            prev->stats.forced++;
+        else
+            prev->stats.voluntary++;
+        wait = now - next->stamp;
+        next->stats.wait_time += wait;
+        if (wait > next->stats.wait_max)
+            next->stats.wait_max = wait;
+        next->stamp = now;
+    }
+#ifdef CONFIG_PREEMPT
+    need_resched = 0;
+    if (sched_slice) {
+        slice_end = NOW() + sched_slice;
+        /* Slice ends only get later, so this mostly finds the previous one
+         * still armed and leaves it: sched_tick re-arms it when it fires
+         * early, instead of a hypercall on every switch. */
+        set_timer_before(slice_end);
+    }
+#endif
     local_irq_restore(flags);
     /* Interrupting the switch is equivalent to having the next thread
        inturrupted at the return instruction. And therefore at safe point. */
     if(prev != next) switch_threads(prev, next);
 
+    if (MINIOS_TAILQ_EMPTY(&exited_threads))
+        return;
+    /* Take them off the list with events disabled, but free their stacks
+     * with events enabled */
+    local_irq_save(flags);
     MINIOS_TAILQ_FOREACH_SAFE(thread, &exited_threads, thread_list, tmp)
     {
         if(thread != prev)
         {
             MINIOS_TAILQ_REMOVE(&exited_threads, thread, thread_list);
-            free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
-            xfree(thread);
+            MINIOS_TAILQ_INSERT_TAIL(&freed, thread, thread_list);
         }
     }
+    local_irq_restore(flags);
+    MINIOS_TAILQ_FOREACH_SAFE(thread, &freed, thread_list, tmp)
+    {
+        put_stack(thread->stack, thread->stack_size);
+        xfree(thread);
+    }
 }
 
-struct thread* create_thread(char *name, void (*function)(void *), void *data)
+#ifdef CONFIG_PREEMPT
+void set_sched_slice(s_time_t slice)
+{
+    sched_slice = slice;
+}
+
+/* Called from the timer VIRQ handler */
+void sched_tick(void)
+{
+    if (!sched_slice)
+        return;
+    if (NOW() >= slice_end)
+        need_resched = 1;
+    else
+        /* Fired for an earlier deadline, the slice still needs its own */
+        set_timer_before(slice_end);
+}
+
+/* Called with events disabled on return from the event upcall, when the
+ * interrupted thread had them enabled. */
+void preempt_schedule_irq(void)
+{
+    if (!need_resched || !threads_started || preempt_count)
+        return;
+    local_irq_enable();
+    schedule();
+    local_irq_disable();
+}
+
+/* Called by preempt_enable(), to preempt as the upcall would have */
+void preempt_check_resched(void)
+{
+    if (need_resched && threads_started && !in_callback && !irqs_disabled())
+        schedule();
+}
+#endif
+
+/* Stacks of up to half of STACK_SIZE use less memory, larger ones are
+ * rounded up to STACK_SIZE.  0 is STACK_SIZE too. */
+static unsigned long stack_alloc_size(unsigned long stack_size)
+{
+    if (!stack_size || stack_size > STACK_SIZE / 2)
+        return STACK_SIZE;
+    if (stack_size < THREAD_STACK_MIN)
+        return THREAD_STACK_MIN;
+    return (stack_size + PAGE_SIZE - 1) & PAGE_MASK;
+}
+
+unsigned long thread_stack_size(unsigned long stack_size)
+{
+    return arch_stack_usable(stack_alloc_size(stack_size));
+}
+
+struct thread* create_thread_ex(char *name, void (*function)(void *), void *data,
+                                unsigned long stack_size)
 {
     struct thread *thread;
     unsigned long flags;
+    char *stack;
+
+    stack_size = stack_alloc_size(stack_size);
+    stack = get_stack(stack_size);
+    if (!stack)
+        return NULL;
     /* Call architecture specific setup. */
-    thread = arch_create_thread(name, function, data);
+    thread = arch_create_thread(name, function, data, stack, stack_size);
     /* Not runable, not exited, not sleeping */
     thread->flags = 0;
     thread->wakeup_time = 0LL;
+    thread->prio = THREAD_PRIO_NORMAL;
+    thread->stamp = NOW();
+    memset(&thread->stats, 0, sizeof(thread->stats));
+    init_timer(&thread->timer, thread_timeout, thread);
 #ifdef HAVE_LIBC
     _REENT_INIT_PTR((&thread->reent))
+    thread->pthread = NULL;
 #endif
     set_runnable(thread);
     local_irq_save(flags);
     MINIOS_TAILQ_INSERT_TAIL(&thread_list, thread, thread_list);
+    runq_add(thread);
     local_irq_restore(flags);
     return thread;
 }
 
+struct thread* create_thread(char *name, void (*function)(void *), void *data)
+{
+    return create_thread_ex(name, function, data, STACK_SIZE);
+}
+
+int set_thread_priority(struct thread *thread, int prio)
+{
+    unsigned long flags;
+
+    if (prio < 0 || prio >= NR_THREAD_PRIO)
+        return -EINVAL;
+    local_irq_save(flags);
+    if (thread->flags & RUNQ_FLAG) {
+        runq_remove(thread);
+        thread->prio = prio;
+        runq_add(thread);
+    } else
+        thread->prio = prio;
+    local_irq_restore(flags);
+    return 0;
+}
+
 #ifdef HAVE_LIBC
 static struct _reent callback_reent;
 struct _reent *__getreent(void)
@@ -198,10 +572,16 @@ void exit_thread(void)
     unsigned long flags;
     struct thread *thread = current;
     printk("Thread \"%s\" exited.\n", thread->name);
+#ifdef HAVE_LIBC
+    if (thread->pthread)
+        pthread_thread_exit(thread);
+#endif
     local_irq_save(flags);
     /* Remove from the thread list */
     MINIOS_TAILQ_REMOVE(&thread_list, thread, thread_list);
     clear_runnable(thread);
+    runq_remove(thread);
+    timer_del(&thread->timer);
     /* Put onto exited list */
     MINIOS_TAILQ_INSERT_HEAD(&exited_threads, thread, thread_list);
     local_irq_restore(flags);
@@ -229,8 +609,31 @@ void msleep(uint32_t millisecs)
 
 void wake(struct thread *thread)
 {
+    unsigned long flags;
+
+    local_irq_save(flags);
     thread->wakeup_time = 0LL;
+    timer_del(&thread->timer);
+    if (!is_runnable(thread)) {
+        thread->stats.wakeups++;
+        /* The running thread is accounted for by schedule() */
+        if (thread != get_current()) {
+            s_time_t now = NOW();
+
+            thread->stats.block_time += now - thread->stamp;
+            thread->stamp = now;
+        }
+    }
     set_runnable(thread);
+    /* schedule() queues the running thread itself */
+    if (thread != get_current()) {
+        runq_add(thread);
+#ifdef CONFIG_PREEMPT
+        if (sched_slice && thread->prio < get_current()->prio)
+            need_resched = 1;
+#endif
+    }
+    local_irq_restore(flags);
 }
 
 void idle_thread_fn(void *unused)
@@ -0,0 +1,179 @@
+/*
+ * Task executor: runs the queued tasks one after the other on the "tasks"
+ * thread, and sleeps on the pollers' wait queues when none is queued.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/errno.h>
+#include <mini-os/task.h>
+#ifdef CONFIG_BLKFRONT
+#include <mini-os/blkfront.h>
+#endif
+
+MINIOS_TAILQ_HEAD(task_list, struct task);
+MINIOS_TAILQ_HEAD(task_poller_list, struct task_poller);
+
+static struct task_list task_queue = MINIOS_TAILQ_HEAD_INITIALIZER(task_queue);
+static struct task_poller_list task_pollers =
+    MINIOS_TAILQ_HEAD_INITIALIZER(task_pollers);
+static struct thread *task_thread;
+
+static void task_timeout(void *data)
+{
+    task_wake(data);
+}
+
+void task_init(struct task *task, void (*fn)(struct task *task), void *data)
+{
+    memset(task, 0, sizeof(*task));
+    task->fn = fn;
+    task->data = data;
+    init_timer(&task->timer, task_timeout, task);
+}
+
+struct task *task_create(void (*fn)(struct task *task), void *data)
+{
+    struct task *task = xmalloc(struct task);
+
+    if (!task)
+        return NULL;
+    task_init(task, fn, data);
+    task->flags = TASK_ALLOCATED;
+    return task;
+}
+
+void task_wake(struct task *task)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (!(task->flags & TASK_QUEUED)) {
+        task->flags |= TASK_QUEUED;
+        MINIOS_TAILQ_INSERT_TAIL(&task_queue, task, run_list);
+        if (task_thread)
+            wake(task_thread);
+    }
+    local_irq_restore(flags);
+}
+
+void task_evtchn_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+    task_wake(data);
+}
+
+void task_xenbus_reply(struct xsd_sockmsg *reply, void *data)
+{
+    struct task *task = data;
+
+    task->reply = reply;
+    task_wake(task);
+}
+
+#ifdef CONFIG_BLKFRONT
+void task_aio_cb(struct blkfront_aiocb *aiocb, int ret)
+{
+    struct task *task = aiocb->data;
+
+    task->result = ret;
+    task_wake(task);
+}
+#endif
+
+void task_add_poller(struct task_poller *poller)
+{
+    unsigned long flags;
+
+    init_waitqueue_entry(&poller->waiter, NULL);
+    local_irq_save(flags);
+    MINIOS_TAILQ_INSERT_TAIL(&task_pollers, poller, list);
+    local_irq_restore(flags);
+    /* It may have completions to run already */
+    if (task_thread)
+        wake(task_thread);
+}
+
+void task_remove_poller(struct task_poller *poller)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    remove_wait_queue(poller->queue, &poller->waiter);
+    MINIOS_TAILQ_REMOVE(&task_pollers, poller, list);
+    local_irq_restore(flags);
+}
+
+static void task_run(struct task *task)
+{
+    task->fn(task);
+    if (task->state == TASK_DONE && (task->flags & TASK_ALLOCATED)) {
+        timer_del(&task->timer);
+        /* Woken meanwhile, e.g. by a late completion */
+        if (!(task->flags & TASK_QUEUED))
+            xfree(task);
+    }
+}
+
+static void task_executor(void *unused)
+{
+    struct task_poller *poller;
+    struct task *task;
+    unsigned long flags;
+
+    for (;;) {
+        local_irq_save(flags);
+        task = MINIOS_TAILQ_FIRST(&task_queue);
+        if (task) {
+            MINIOS_TAILQ_REMOVE(&task_queue, task, run_list);
+            task->flags &= ~TASK_QUEUED;
+        }
+        local_irq_restore(flags);
+        if (task) {
+            task_run(task);
+            continue;
+        }
+
+        /* Wait on the pollers' queues before polling, not to miss any
+         * completion */
+        local_irq_save(flags);
+        MINIOS_TAILQ_FOREACH(poller, &task_pollers, list) {
+            poller->waiter.thread = current;
+            add_wait_queue(poller->queue, &poller->waiter);
+        }
+        /* Unless woken since the queue was looked at */
+        if (MINIOS_TAILQ_EMPTY(&task_queue))
+            block(current);
+        local_irq_restore(flags);
+        MINIOS_TAILQ_FOREACH(poller, &task_pollers, list)
+            poller->poll(poller->data);
+        schedule();
+        local_irq_save(flags);
+        MINIOS_TAILQ_FOREACH(poller, &task_pollers, list)
+            remove_wait_queue(poller->queue, &poller->waiter);
+        local_irq_restore(flags);
+    }
+}
+
+int task_start(struct task *task)
+{
+    if (!task_thread) {
+        task_thread = create_thread_ex("tasks", task_executor, NULL, 0);
+        if (!task_thread)
+            return -ENOMEM;
+    }
+    task_wake(task);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
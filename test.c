@@ -31,6 +31,7 @@
 #include <mini-os/mm.h>
 #include <mini-os/events.h>
 #include <mini-os/time.h>
+#include <mini-os/timer.h>
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/sched.h>
@@ -55,16 +56,14 @@ static void xenbus_tester(void *p)
     /* test_xenbus(); */
 }
 
-static void periodic_thread(void *p)
+static struct timer periodic_timer;
+
+static void periodic_fn(void *p)
 {
     struct timeval tv;
-    printk("Periodic thread started.\n");
-    for(;;)
-    {
-        gettimeofday(&tv, NULL);
-        printk("T(s=%ld us=%ld)\n", tv.tv_sec, tv.tv_usec);
-        msleep(1000);
-    }
+    gettimeofday(&tv, NULL);
+    printk("T(s=%ld us=%ld)\n", tv.tv_sec, tv.tv_usec);
+    timer_add(&periodic_timer, periodic_timer.expires + MILLISECS(1000));
 }
 
 static void netfront_thread(void *p)
@@ -441,7 +440,8 @@ int app_main(start_info_t *si)
 {
     printk("Test main: start_info=%p\n", si);
     create_thread("xenbus_tester", xenbus_tester, si);
-    create_thread("periodic_thread", periodic_thread, si);
+    init_timer(&periodic_timer, periodic_fn, si);
+    timer_add(&periodic_timer, NOW());
     create_thread("netfront", netfront_thread, si);
     create_thread("blkfront", blkfront_thread, si);
     create_thread("fbfront", fbfront_thread, si);
@@ -0,0 +1,140 @@
+/*
+ * Kernel timers, kept in a pairing heap ordered by expiry: arming is O(1),
+ * removing O(log n) amortized, and no memory is allocated.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/timer.h>
+
+static struct timer *timer_root;
+
+/* Both are roots, the later one becomes the first child of the other */
+static struct timer *timer_meld(struct timer *a, struct timer *b)
+{
+    struct timer *tmp;
+
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (b->expires < a->expires) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+    b->prev = a;
+    b->next = a->child;
+    if (a->child)
+        a->child->prev = b;
+    a->child = b;
+    return a;
+}
+
+/* Meld a list of siblings into one heap, in two passes */
+static struct timer *timer_merge_pairs(struct timer *first)
+{
+    struct timer *pairs = NULL, *root = NULL, *a, *b;
+
+    /* Meld pairs from left to right, stacking them through next */
+    while (first) {
+        a = first;
+        b = a->next;
+        first = b ? b->next : NULL;
+        a->next = a->prev = NULL;
+        if (b) {
+            b->next = b->prev = NULL;
+            a = timer_meld(a, b);
+        }
+        a->next = pairs;
+        pairs = a;
+    }
+
+    /* And meld them from right to left */
+    while (pairs) {
+        a = pairs;
+        pairs = a->next;
+        a->next = NULL;
+        root = timer_meld(root, a);
+    }
+    return root;
+}
+
+/* Called with IRQs disabled */
+static void timer_remove(struct timer *timer)
+{
+    struct timer *sub = timer_merge_pairs(timer->child);
+
+    if (timer == timer_root)
+        timer_root = sub;
+    else {
+        if (timer->prev->child == timer)
+            timer->prev->child = timer->next;
+        else
+            timer->prev->next = timer->next;
+        if (timer->next)
+            timer->next->prev = timer->prev;
+        timer_root = timer_meld(timer_root, sub);
+    }
+    timer->child = timer->next = timer->prev = NULL;
+    timer->pending = 0;
+}
+
+void init_timer(struct timer *timer, void (*function)(void *data), void *data)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->function = function;
+    timer->data = data;
+}
+
+int timer_mod(struct timer *timer, s_time_t expires)
+{
+    unsigned long flags;
+    int pending;
+
+    local_irq_save(flags);
+    pending = timer->pending;
+    if (pending)
+        timer_remove(timer);
+    timer->expires = expires;
+    timer->pending = 1;
+    timer_root = timer_meld(timer_root, timer);
+    local_irq_restore(flags);
+    return pending;
+}
+
+void timer_add(struct timer *timer, s_time_t expires)
+{
+    timer_mod(timer, expires);
+}
+
+int timer_del(struct timer *timer)
+{
+    unsigned long flags;
+    int pending;
+
+    local_irq_save(flags);
+    pending = timer->pending;
+    if (pending)
+        timer_remove(timer);
+    local_irq_restore(flags);
+    return pending;
+}
+
+s_time_t timer_next(void)
+{
+    return timer_root ? timer_root->expires : 0;
+}
+
+void timer_run(s_time_t now)
+{
+    struct timer *timer;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    while ((timer = timer_root) && timer->expires <= now) {
+        timer_remove(timer);
+        timer->function(timer->data);
+    }
+    local_irq_restore(flags);
+}
@@ -24,6 +24,7 @@
 #include <mini-os/errno.h>
 #include <mini-os/sched.h>
 #include <mini-os/wait.h>
+#include <mini-os/rcu.h>
 #include <xen/io/xs_wire.h>
 #include <mini-os/spinlock.h>
 #include <mini-os/xmalloc.h>
@@ -46,6 +47,7 @@ static DECLARE_WAIT_QUEUE_HEAD(xb_waitq);
 DECLARE_WAIT_QUEUE_HEAD(xenbus_watch_queue);
 
 xenbus_event_queue xenbus_events;
+/* Looked up under RCU, updated with IRQs disabled */
 static struct watch {
     char *token;
     xenbus_event_queue *events;
@@ -56,11 +58,16 @@ struct xenbus_req_info
     int in_use:1;
     struct wait_queue_head waitq;
     void *reply;
+    /* Called with the reply instead of waking waitq */
+    xenbus_reply_fn_t reply_fn;
+    void *reply_data;
 };
 
 #define NR_REQS 32
 static struct xenbus_req_info req_info[NR_REQS];
 
+static void release_xenbus_id(int id);
+
 static void memcpy_from_ring(const void *Ring,
         void *Dest,
         int off,
@@ -78,15 +85,20 @@ static void memcpy_from_ring(const void *Ring,
 char **xenbus_wait_for_watch_return(xenbus_event_queue *queue)
 {
     struct xenbus_event *event;
+    unsigned long flags;
     DEFINE_WAIT(w);
     if (!queue)
         queue = &xenbus_events;
+    local_irq_save(flags);
     while (!(event = *queue)) {
         add_waiter(w, xenbus_watch_queue);
+        local_irq_restore(flags);
         schedule();
+        local_irq_save(flags);
     }
     remove_waiter(w, xenbus_watch_queue);
     *queue = event->next;
+    local_irq_restore(flags);
     return &event->path;
 }
 
@@ -238,15 +250,22 @@ static void xenbus_thread_func(void *ign)
 
                 xenstore_buf->rsp_cons += msg.len + sizeof(msg);
 
-                for (watch = watches; watch; watch = watch->next)
+                rcu_read_lock();
+                for (watch = rcu_dereference(watches); watch;
+                     watch = rcu_dereference(watch->next))
                     if (!strcmp(watch->token, event->token)) {
                         events = watch->events;
                         break;
                     }
+                rcu_read_unlock();
 
                 if (events) {
+                    unsigned long flags;
+
+                    local_irq_save(flags);
                     event->next = *events;
                     *events = event;
+                    local_irq_restore(flags);
                     wake_up(&xenbus_watch_queue);
                 } else {
                     printk("unexpected watch token %s\n", event->token);
@@ -262,7 +281,14 @@ static void xenbus_thread_func(void *ign)
                     MASK_XENSTORE_IDX(xenstore_buf->rsp_cons),
                     msg.len + sizeof(msg));
                 xenstore_buf->rsp_cons += msg.len + sizeof(msg);
-                wake_up(&req_info[msg.req_id].waitq);
+                if (req_info[msg.req_id].reply_fn) {
+                    xenbus_reply_fn_t fn = req_info[msg.req_id].reply_fn;
+                    void *data = req_info[msg.req_id].reply_data;
+
+                    fn(req_info[msg.req_id].reply, data);
+                    release_xenbus_id(msg.req_id);
+                } else
+                    wake_up(&req_info[msg.req_id].waitq);
             }
         }
     }
@@ -281,14 +307,18 @@ static DECLARE_WAIT_QUEUE_HEAD(req_wq);
 /* Release a xenbus identifier */
 static void release_xenbus_id(int id)
 {
+    unsigned long flags;
+
     BUG_ON(!req_info[id].in_use);
+    /* Not to be preempted with the lock held */
+    local_irq_save(flags);
     spin_lock(&req_lock);
     req_info[id].in_use = 0;
     nr_live_reqs--;
     req_info[id].in_use = 0;
-    if (nr_live_reqs == NR_REQS - 1)
-        wake_up(&req_wq);
+    wake_up_one(&req_wq);
     spin_unlock(&req_lock);
+    local_irq_restore(flags);
 }
 
 /* Allocate an identifier for a xenbus request.  Blocks if none are
@@ -297,14 +327,17 @@ static int allocate_xenbus_id(void)
 {
     static int probe;
     int o_probe;
+    unsigned long flags;
 
     while (1) 
     {
+        local_irq_save(flags);
         spin_lock(&req_lock);
         if (nr_live_reqs < NR_REQS)
             break;
         spin_unlock(&req_lock);
-        wait_event(req_wq, (nr_live_reqs < NR_REQS));
+        local_irq_restore(flags);
+        wait_event_exclusive(req_wq, (nr_live_reqs < NR_REQS));
     }
 
     o_probe = probe;
@@ -319,7 +352,9 @@ static int allocate_xenbus_id(void)
     req_info[o_probe].in_use = 1;
     probe = (o_probe + 1) % NR_REQS;
     spin_unlock(&req_lock);
+    local_irq_restore(flags);
     init_waitqueue_head(&req_info[o_probe].waitq);
+    req_info[o_probe].reply_fn = NULL;
 
     return o_probe;
 }
@@ -330,7 +365,8 @@ void init_xenbus(void)
     int err;
     DEBUG("init_xenbus called.\n");
     xenstore_buf = mfn_to_virt(start_info.store_mfn);
-    create_thread("xenstore", xenbus_thread_func, NULL);
+    set_thread_priority(create_thread("xenstore", xenbus_thread_func, NULL),
+                        THREAD_PRIO_HIGH);
     DEBUG("buf at %p.\n", xenstore_buf);
     err = bind_evtchn(start_info.store_evtchn,
 		      xenbus_evtchn_handler,
@@ -352,6 +388,7 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 		     const struct write_req *req, int nr_reqs)
 {
     XENSTORE_RING_IDX prod;
+    unsigned long flags;
     int r;
     int len = 0;
     const struct write_req *cur_req;
@@ -371,19 +408,24 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 
     BUG_ON(len > XENSTORE_RING_SIZE);
     /* Wait for the ring to drain to the point where we can send the
-       message. */
-    prod = xenstore_buf->req_prod;
-    if (prod + len - xenstore_buf->req_cons > XENSTORE_RING_SIZE) 
+       message.  Events stay disabled from then on, so that another writer
+       preempting us does not interleave its message with ours. */
+    local_irq_save(flags);
+    while (xenstore_buf->req_prod + len - xenstore_buf->req_cons >
+            XENSTORE_RING_SIZE)
     {
         /* Wait for there to be space on the ring */
         DEBUG("prod %d, len %d, cons %d, size %d; waiting.\n",
-                prod, len, xenstore_buf->req_cons, XENSTORE_RING_SIZE);
+                xenstore_buf->req_prod, len, xenstore_buf->req_cons,
+                XENSTORE_RING_SIZE);
+        local_irq_restore(flags);
         wait_event(xb_waitq,
                 xenstore_buf->req_prod + len - xenstore_buf->req_cons <=
                 XENSTORE_RING_SIZE);
         DEBUG("Back from wait.\n");
-        prod = xenstore_buf->req_prod;
+        local_irq_save(flags);
     }
+    prod = xenstore_buf->req_prod;
 
     /* We're now guaranteed to be able to send the message without
        overflowing the ring.  Do so. */
@@ -417,6 +459,7 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
     wmb();
 
     xenstore_buf->req_prod += len;
+    local_irq_restore(flags);
 
     /* Send evtchn to notify remote */
     notify_remote_via_evtchn(start_info.store_evtchn);
@@ -450,6 +493,20 @@ xenbus_msg_reply(int type,
     return rep;
 }
 
+void xenbus_msg_reply_async(int type,
+                            xenbus_transaction_t trans,
+                            struct write_req *io,
+                            int nr_reqs,
+                            xenbus_reply_fn_t fn, void *data)
+{
+    int id;
+
+    id = allocate_xenbus_id();
+    req_info[id].reply_fn = fn;
+    req_info[id].reply_data = data;
+    xb_write(type, id, trans, io, nr_reqs);
+}
+
 static char *errmsg(struct xsd_sockmsg *rep)
 {
     char *res;
@@ -560,14 +617,17 @@ char* xenbus_watch_path_token( xenbus_transaction_t xbt, const char *path, const
     struct watch *watch = malloc(sizeof(*watch));
 
     char *msg;
+    unsigned long flags;
 
     if (!events)
         events = &xenbus_events;
 
     watch->token = strdup(token);
     watch->events = events;
+    local_irq_save(flags);
     watch->next = watches;
-    watches = watch;
+    rcu_assign_pointer(watches, watch);
+    local_irq_restore(flags);
 
     rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
 
@@ -590,6 +650,7 @@ char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, con
     struct watch *watch, **prev;
 
     char *msg;
+    unsigned long flags;
 
     rep = xenbus_msg_reply(XS_UNWATCH, xbt, req, ARRAY_SIZE(req));
 
@@ -597,13 +658,19 @@ char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, con
     if (msg) return msg;
     free(rep);
 
+    local_irq_save(flags);
     for (prev = &watches, watch = *prev; watch; prev = &watch->next, watch = *prev)
         if (!strcmp(watch->token, token)) {
-            free(watch->token);
-            *prev = watch->next;
-            free(watch);
+            rcu_assign_pointer(*prev, watch->next);
             break;
         }
+    local_irq_restore(flags);
+    if (watch) {
+        /* The xenstore thread may be looking at it */
+        synchronize_rcu();
+        free(watch->token);
+        free(watch);
+    }
 
     return NULL;
 }